@@ -1,5 +1,6 @@
 #define _POSIX_C_SOURCE 200809L //https://www.ibm.com/docs/en/zos/2.5.0?topic=files-feature-test-macros
 #define _DEFAULT_SOURCE
+#define _GNU_SOURCE //splice(), pipe2()
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
@@ -9,21 +10,44 @@
 #include <pwd.h> 
 #include <stdlib.h> 
 #include <limits.h> 
-#include <ctype.h>
 
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <time.h>
 #include <errno.h>
 
 #include <signal.h>
+#include <spawn.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <malloc.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/uio.h>
 
 #ifndef PATH_MAX
 #define PATH_MAX 4096
 #endif
 
+extern char **environ;
+
 static int builtin_cd(char **argv, int argc);
 static int builtin_bg(char **argv, int argc);
 static int builtin_bglist(char **argv, int argc);
+static int builtin_hash(char **argv, int argc);
+static int builtin_splice(char **argv, int argc);
+static int builtin_arena(char **argv, int argc);
+static int builtin_parallel(char **argv, int argc);
+static int builtin_time(char **argv, int argc);
+static int builtin_history(char **argv, int argc);
 
 /*
 Helper function to get and return the current user's login name
@@ -55,128 +79,316 @@ static const char* get_username(void){
 }
 
 /*
-Helper function to build the shell prompt in the format:
+Prompt cache. The prompt has the format:
 username@hostname: current_directory > 
-The function uses username, hostname and current working 
-directory and returns a heap allocated string.
+The username and hostname are looked up once by prompt_init() (getpwuid()
+can be slow on NSS/LDAP hosts), and the directory is refreshed by
+prompt_set_cwd() only when cd changes it. build_prompt() formats into one
+static buffer, and only after one of those inputs has changed.
 */
-static char* build_prompt(void){
-    char host[256] = "host";
-    (void)gethostname(host, sizeof(host));
+static struct {
+    char user[256];
+    char host[256];
+    char cwd[PATH_MAX];
+    char buf[PATH_MAX + 2 * 256 + 8];
+    int dirty;          //buf is out of date
+} prompt_cache;
 
-    char cwd[PATH_MAX] = "/";
-    if(!getcwd(cwd, sizeof(cwd))){ //absolute path of cwd
-        strncpy(cwd, "?", sizeof(cwd));
-        cwd[sizeof(cwd)-1] = '\0';
+//Helper to record the current working directory for the prompt
+static void prompt_set_cwd(void){
+    if(!getcwd(prompt_cache.cwd, sizeof(prompt_cache.cwd))){ //absolute path of cwd
+        strcpy(prompt_cache.cwd, "?");
     }
+    prompt_cache.dirty = 1;
+}
 
-    //Format prompt
-    char buf[PATH_MAX + 256];
-    int n = snprintf(buf, sizeof(buf), "%s@%s: %s > ", get_username(), host, cwd);
+static void prompt_init(void){
+    snprintf(prompt_cache.user, sizeof(prompt_cache.user), "%s", get_username());
+    strcpy(prompt_cache.host, "host");
+    if(gethostname(prompt_cache.host, sizeof(prompt_cache.host)) == 0){
+        prompt_cache.host[sizeof(prompt_cache.host)-1] = '\0'; //a truncated name may be unterminated
+    }
+    prompt_set_cwd();
+}
 
-    if(n < 0){
-        return strdup("> ");
+//Returns the prompt in a static buffer, rebuilt only if an input changed
+static const char* build_prompt(void){
+    if(prompt_cache.dirty){
+        snprintf(prompt_cache.buf, sizeof(prompt_cache.buf), "%s@%s: %s > ",
+                 prompt_cache.user, prompt_cache.host, prompt_cache.cwd);
+        prompt_cache.dirty = 0;
     }
-    buf[sizeof(buf)-1] = '\0'; //Terminate
-    return strdup(buf);
+    return prompt_cache.buf;
 }
 
 /*
-Helper function to remove leading and trailing whitespace characters
-from readline() before tokenizing.
+Line Arena - scratch memory for one command line. lex_line(),
+builtin_cd() and join_argv() allocate from it and nothing is freed one by
+one: run_line() resets it after each command. Anything that must outlive
+the line (job records, cached paths) is copied out with malloc. When a
+line needs more than one chunk, the chain is replaced on reset by a
+single chunk of the combined size, so after warm-up a line costs no
+malloc() at all. The arena builtin prints the counters.
 */
-static void trim(char *s){
-    if(!s){
-        return;
+#define ARENA_CHUNK (1 << 12)
+
+typedef struct ArenaChunk{
+    struct ArenaChunk *next;
+    size_t cap;
+    size_t used;
+    max_align_t data[]; //allocations start suitably aligned for any type
+} ArenaChunk;
+
+static ArenaChunk *arena_head = NULL;
+static size_t arena_line_bytes = 0;
+
+static struct {
+    unsigned long lines;        //resets, one per command line
+    unsigned long allocs;       //arena_alloc() calls
+    unsigned long long bytes;   //bytes handed out
+    size_t peak_line_bytes;     //most any single line used
+    unsigned long chunk_mallocs;//malloc() calls made by the arena itself
+} arena_stats;
+
+static void* arena_alloc(size_t n){
+    n = (n + sizeof(max_align_t) - 1) & ~(sizeof(max_align_t) - 1);
+    ArenaChunk *c = arena_head;
+    if(!c || c->cap - c->used < n){
+        size_t cap = ARENA_CHUNK;
+        while(cap < n){
+            cap *= 2;
+        }
+        c = (ArenaChunk*)malloc(sizeof(ArenaChunk) + cap);
+        if(!c){
+            perror("malloc");
+            exit(1);
+        }
+        c->next = arena_head;
+        c->cap = cap;
+        c->used = 0;
+        arena_head = c;
+        arena_stats.chunk_mallocs++;
     }
-    size_t i = 0;
-    while(s[i] && isspace((unsigned char)s[i])){
-        i++;
+    void *p = (char*)c->data + c->used;
+    c->used += n;
+    arena_stats.allocs++;
+    arena_stats.bytes += n;
+    arena_line_bytes += n;
+    return p;
+}
+
+static char* arena_strdup(const char *s){
+    size_t n = strlen(s) + 1;
+    return memcpy(arena_alloc(n), s, n);
+}
+
+//Helper to release everything the last line allocated
+static void arena_reset(void){
+    if(arena_head && arena_head->next){
+        size_t total = 0;
+        while(arena_head){
+            ArenaChunk *c = arena_head;
+            arena_head = c->next;
+            total += c->cap;
+            free(c);
+        }
+        ArenaChunk *c = (ArenaChunk*)malloc(sizeof(ArenaChunk) + total);
+        if(c){
+            c->next = NULL;
+            c->cap = total;
+            arena_stats.chunk_mallocs++;
+        }
+        arena_head = c;
     }
-    if(i > 0){
-        memmove(s, s+i, strlen(s + i) + 1);
+    if(arena_head){
+        arena_head->used = 0;
     }
-    size_t n = strlen(s);
-    while(n > 0 && isspace((unsigned char)s[n-1])){
-        n--;
+    if(arena_line_bytes > arena_stats.peak_line_bytes){
+        arena_stats.peak_line_bytes = arena_line_bytes;
     }
-    s[n] = '\0'; //Termination
+    arena_line_bytes = 0;
+    arena_stats.lines++;
 }
 
+/*
+Lexer - one pass over a command line, splitting it into argv[] in place.
+Blanks separate words; '|', '<' and '>' are operators even without blanks
+around them and come back as the TOK_* strings, so a quoted "|" stays an
+ordinary word. Inside a word:
+    'text'   is taken literally
+    "text"   is taken literally except for \" \\ \$ \`
+    \c       is c, for any character c
+A word that starts with an unquoted ~ followed by / (or nothing) gets $HOME
+in its place, and a word that starts with # begins a comment. Quote removal
+only makes words shorter, so they are written back over the line itself and
+only argv[] and tilde-expanded words take space in the line arena.
+*/
+static char lex_ops[] = "|\0<\0>";
+#define TOK_PIPE (lex_ops)
+#define TOK_IN   (lex_ops + 2)
+#define TOK_OUT  (lex_ops + 4)
 
-// Helper function to tokenize input command line
-static int tokenize(char *line, char ***argv_out){
-    int capacity = 8;
-    int argc = 0;
-    char **argv = malloc(sizeof(char*) * capacity);
-    if(!argv){
-        perror("malloc");
-        exit(1);
-    }
-    char *save = NULL;
-    for(char *tok = strtok_r(line, " \t\r\n", &save); tok!=NULL; tok = strtok_r(NULL, " \t\r\n", &save)){
-        if(argc == capacity){
-            capacity = capacity * 2;
-            char **temp = realloc(argv, sizeof(char*) * capacity);
-            if(!temp){
-                perror("realloc");
-                free(argv);
-                exit(1);
-            }
-            argv = temp;
+//Byte classes: blanks end a word, and so does every other byte listed
+#define LEX_BLANK 1
+#define LEX_STOP  2
+static const unsigned char lex_class[256] = {
+    [' '] = LEX_BLANK, ['\t'] = LEX_BLANK, ['\r'] = LEX_BLANK, ['\n'] = LEX_BLANK,
+    ['\0'] = LEX_STOP, ['\''] = LEX_STOP, ['"'] = LEX_STOP, ['\\'] = LEX_STOP,
+    ['|'] = LEX_STOP, ['<'] = LEX_STOP, ['>'] = LEX_STOP,
+};
+#define lex_blank(c) (lex_class[(unsigned char)(c)] & LEX_BLANK)
+#define lex_plain(c) (lex_class[(unsigned char)(c)] == 0)
+
+//Word-at-a-time tests: the high bit of each byte of x that is below n (or equal to c) is set; the lowest set bit is exact
+#define LEX_ONES  0x0101010101010101ULL
+#define LEX_HIGHS 0x8080808080808080ULL
+#define lex_below(x, n) (((x) - LEX_ONES * (n)) & ~(x) & LEX_HIGHS)
+#define lex_equal(x, c) lex_below((x) ^ (LEX_ONES * (c)), 1)
+
+/*
+Helper function to measure the run of plain word bytes at p, eight at a
+time while there are eight left. Every byte the lexer treats specially is
+below '(' or one of < > \ |, so the test never misses one; it may stop
+early on a harmless byte such as '$', which the caller simply copies.
+*/
+static size_t lex_plain_run(const char *p, const char *end){
+    const char *s = p;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    while(end - s >= 8){
+        uint64_t x;
+        memcpy(&x, s, sizeof(x));
+        uint64_t m = lex_below(x, '(') | lex_equal(x, '<') | lex_equal(x, '>') | lex_equal(x, '\\') | lex_equal(x, '|');
+        if(m){
+            return (size_t)(s - p) + (size_t)(__builtin_ctzll(m) >> 3);
         }
-        argv[argc++] = tok;
+        s += 8;
     }
-    if(argc == capacity){
-        char **tmp = realloc(argv, sizeof(char*) * (capacity + 1));
-        if(!tmp){
-            perror("realloc");
-            free(argv);
-            exit(1);
-        }
-        argv = tmp;
+#endif
+    while(s < end && lex_plain(*s)){
+        s++;
     }
-    argv[argc] = NULL;
-    *argv_out = argv;
-    return argc;
+    return (size_t)(s - p);
 }
 
-// Expand ~ and ~/<path> to absolute paths using $HOME
-static char* my_expand(const char *arg){
-    if(!arg){
-        return NULL;
-    }
-    if(arg[0] != '~'){
-        return strdup(arg);
-    }
+//Replace the leading ~ of word with $HOME (result lives in the line arena)
+static char* lex_tilde(const char *word){
     const char *home = getenv("HOME");
     if((!home) || (!*home)){
         home = "/";
     }
-    if(arg[1] == '\0'){
-        return strdup(home);
-    }
-    else if(arg[1] == '/'){
-        size_t need = strlen(home) + strlen(arg) + 1; //+1 for Null terminator
-        char *out = (char*)malloc(need);
-        if(!out){
-            perror("malloc");
-            exit(1);
+    size_t hlen = strlen(home), wlen = strlen(word + 1);
+    char *out = arena_alloc(hlen + wlen + 1);
+    memcpy(out, home, hlen);
+    memcpy(out + hlen, word + 1, wlen + 1);
+    return out;
+}
+
+/*
+Split line (len bytes, NUL-terminated) into a NULL-terminated argv[] in the
+line arena; argv grows by doubling, so the line is never measured first.
+Returns the word count, or -1 after printing an error for an unterminated
+quote.
+*/
+static int lex_line(char *line, size_t len, char ***argv_out){
+    char *src = line, *dst = line;
+    char *end = line + len;
+    int argc = 0, cap = 64;
+    char **argv = arena_alloc(sizeof(char*) * cap);
+    for(;;){
+        while(src < end && lex_blank(*src)){
+            src++;
+        }
+        if(src == end || *src == '#'){
+            break;
+        }
+        if(argc + 3 > cap){ //a word, the operator after it and the NULL
+            char **bigger = arena_alloc(sizeof(char*) * cap * 2);
+            memcpy(bigger, argv, sizeof(char*) * argc);
+            argv = bigger;
+            cap *= 2;
+        }
+        if(*src == '|' || *src == '<' || *src == '>'){
+            argv[argc++] = *src == '|' ? TOK_PIPE : *src == '<' ? TOK_IN : TOK_OUT;
+            src++;
+            continue;
+        }
+
+        char *word = dst;
+        int tilde = *src == '~';
+        while(src < end){
+            size_t n = lex_plain_run(src, end);
+            if(n > 0){
+                if(dst != src){
+                    memmove(dst, src, n);
+                }
+                dst += n;
+                src += n;
+                continue;
+            }
+            char c = *src;
+            if(lex_blank(c) || c == '|' || c == '<' || c == '>'){
+                break;
+            }
+            if(c == '\''){
+                char *q = memchr(src + 1, '\'', (size_t)(end - src - 1));
+                if(!q){
+                    fprintf(stderr, "ssi: unterminated quote\n");
+                    return -1;
+                }
+                n = (size_t)(q - src - 1);
+                memmove(dst, src + 1, n);
+                dst += n;
+                src = q + 1;
+            }
+            else if(c == '"'){
+                src++;
+                while(src < end && *src != '"'){
+                    if(*src == '\\' && src + 1 < end && strchr("\"\\$`", src[1])){
+                        src++;
+                    }
+                    *dst++ = *src++;
+                }
+                if(src == end){
+                    fprintf(stderr, "ssi: unterminated quote\n");
+                    return -1;
+                }
+                src++;
+            }
+            else if(c == '\\'){
+                src++;
+                if(src < end){
+                    *dst++ = *src++;
+                }
+            }
+            else{
+                *dst++ = *src++; //a byte the word-at-a-time test stopped on needlessly
+            }
+        }
+        //Take the delimiter before its byte can be overwritten by the terminator
+        char *op = NULL;
+        if(src < end){
+            op = *src == '|' ? TOK_PIPE : *src == '<' ? TOK_IN : *src == '>' ? TOK_OUT : NULL;
+            src++;
+        }
+        *dst++ = '\0';
+        argv[argc++] = (tilde && (word[1] == '/' || word[1] == '\0')) ? lex_tilde(word) : word;
+        if(op){
+            argv[argc++] = op;
         }
-        snprintf(out, need, "%s%s", home, arg + 1);
-        return out;
     }
-    return strdup(arg);
+    argv[argc] = NULL;
+    *argv_out = argv;
+    return argc;
 }
 
 static int builtin_cd(char **argv, int argc){
     char *target = NULL;
     if(argc == 1){
         const char *home = getenv("HOME");
-        target = strdup((home && *home) ? home : "/");
+        target = arena_strdup((home && *home) ? home : "/");
     }
     else{
-        target = my_expand(argv[1]);
+        target = argv[1]; //~ already expanded by the lexer
     }
 
     if(!target){
@@ -186,7 +398,9 @@ static int builtin_cd(char **argv, int argc){
     if(chdir(target) == -1){
         perror("cd");
     }
-    free(target);
+    else{
+        prompt_set_cwd();
+    }
     return 1;
 }
 
@@ -203,230 +417,1916 @@ static int handle_builtin(char **argv, int argc){
     if(strcmp(argv[0], "bglist") == 0){
         return builtin_bglist(argv, argc);
     }
+    if(strcmp(argv[0], "hash") == 0){
+        return builtin_hash(argv, argc);
+    }
+    if(strcmp(argv[0], "splice") == 0){
+        return builtin_splice(argv, argc);
+    }
+    if(strcmp(argv[0], "arena") == 0){
+        return builtin_arena(argv, argc);
+    }
+    if(strcmp(argv[0], "parallel") == 0){
+        return builtin_parallel(argv, argc);
+    }
+    if(strcmp(argv[0], "time") == 0){
+        return builtin_time(argv, argc);
+    }
+    if(strcmp(argv[0], "history") == 0){
+        return builtin_history(argv, argc);
+    }
     return 0;
 }
 
-// fork() to create a child
-// Child --> execvp(argv[0], argv)
-// Parent --> waitpid() for the child to finish 
-static void run_foreground(char **argv){
-    if(!argv || !argv[0]){
-        return;
+//Command Path Cache (hash builtin)
+#define HASH_BUCKETS 256
+
+typedef struct CmdPath{
+    char *name;     //command as typed
+    char *path;     //where it was found in $PATH
+    int hits;       //times it was run from the cache
+    struct CmdPath *next;
+} CmdPath;
+
+static CmdPath *cmd_hash[HASH_BUCKETS];
+static char *hash_path_env = NULL; //$PATH the cached entries were resolved against
+
+static unsigned int hash_name(const char *name){
+    unsigned int h = 2166136261u; //FNV-1a
+    for(const unsigned char *p = (const unsigned char*)name; *p; p++){
+        h = (h ^ *p) * 16777619u;
     }
+    return h % HASH_BUCKETS;
+}
 
-    // parent temporarily ignores SIGINT so Ctrl-C goes to child only
-    struct sigaction oldint, ign;
-    ign.sa_handler = SIG_IGN;
-    sigemptyset(&ign.sa_mask);
-    ign.sa_flags = 0;
-    sigaction(SIGINT, &ign, &oldint);
+//Helper to empty the command path cache
+static void hash_clear(void){
+    for(int b = 0; b < HASH_BUCKETS; b++){
+        while(cmd_hash[b]){
+            CmdPath *e = cmd_hash[b];
+            cmd_hash[b] = e->next;
+            free(e->name);
+            free(e->path);
+            free(e);
+        }
+    }
+}
 
-    pid_t pid = fork();
-    if(pid < 0){
-        perror("fork");
-        sigaction(SIGINT, &oldint, NULL);
-        return;
+//Helper to drop one command from the cache
+static void hash_forget(const char *name){
+    for(CmdPath **pp = &cmd_hash[hash_name(name)]; *pp; pp = &(*pp)->next){
+        if(strcmp((*pp)->name, name) == 0){
+            CmdPath *e = *pp;
+            *pp = e->next;
+            free(e->name);
+            free(e->path);
+            free(e);
+            return;
+        }
     }
-    else if(pid == 0){
-        //Child
-        struct sigaction sa;
-        sa.sa_handler = SIG_DFL;
-        sigemptyset(&sa.sa_mask);
-        sa.sa_flags = 0;
-        sigaction(SIGINT, &sa, NULL);
+}
 
-        execvp(argv[0], argv);
-        fprintf(stderr, "%s: No such file or directory\n", argv[0]);
-        _exit(127);
+/*
+Helper function to search $PATH for an executable regular file called name,
+the same way execvp() would (an empty entry means the current directory).
+Writes the full path to out and returns 1 if found, 0 otherwise.
+*/
+static int search_path(const char *name, char *out, size_t n){
+    const char *path = getenv("PATH");
+    if(!path){
+        path = "/bin:/usr/bin";
     }
-    else{
-        //Parent
-        int status;
-        while(waitpid(pid, &status, 0) == -1){
-            if(errno == EINTR){ //Interrupt
-                continue;
+    size_t name_len = strlen(name);
+    for(const char *dir = path; ; ){
+        const char *end = strchr(dir, ':');
+        size_t dir_len = end ? (size_t)(end - dir) : strlen(dir);
+        if(dir_len + name_len + 2 <= n){
+            if(dir_len == 0){
+                memcpy(out, name, name_len + 1);
+            }
+            else{
+                memcpy(out, dir, dir_len);
+                out[dir_len] = '/';
+                memcpy(out + dir_len + 1, name, name_len + 1);
+            }
+            struct stat st;
+            if(stat(out, &st) == 0 && S_ISREG(st.st_mode) && access(out, X_OK) == 0){
+                return 1;
             }
-            perror("waitpid");
-            break;
         }
-        sigaction(SIGINT, &oldint, NULL);
+        if(!end){
+            return 0;
+        }
+        dir = end + 1;
     }
 }
 
-//Background Jobs
-typedef struct Job{
-    pid_t pid;
-    char *cmdline;
-    struct Job *next;
-} Job;
-
-static Job *jobs_head = NULL;
+/*
+Helper function to find the cache entry for a command without a '/',
+searching $PATH and adding it on the first lookup. The whole cache is
+dropped first if $PATH has changed since it was filled.
+Returns NULL if the command is not in $PATH.
+*/
+static CmdPath* hash_lookup(const char *name){
+    const char *path = getenv("PATH");
+    if(!path){
+        path = "";
+    }
+    if(!hash_path_env || strcmp(hash_path_env, path) != 0){
+        hash_clear();
+        free(hash_path_env);
+        hash_path_env = strdup(path);
+    }
 
-//Helper to add a background job
-static void add_job(pid_t pid, const char *cmdline){
-    Job *j = (Job*)malloc(sizeof(Job));
-    if(!j){
+    unsigned int b = hash_name(name);
+    for(CmdPath *e = cmd_hash[b]; e; e = e->next){
+        if(strcmp(e->name, name) == 0){
+            return e;
+        }
+    }
+    char full[PATH_MAX];
+    if(!search_path(name, full, sizeof(full))){
+        return NULL;
+    }
+    CmdPath *e = (CmdPath*)malloc(sizeof(CmdPath));
+    if(!e){
         perror("malloc");
         exit(1);
     }
-    j->pid = pid;
-    j->cmdline = strdup(cmdline ? cmdline : "");
-    j->next = jobs_head;
-    jobs_head = j;
+    e->name = strdup(name);
+    e->path = strdup(full);
+    e->hits = 0;
+    e->next = cmd_hash[b];
+    cmd_hash[b] = e;
+    return e;
 }
 
-//Helper to remove a background job
-static int remove_job(pid_t pid, char **out_cmd){
-    Job **pp = &jobs_head;
-    while(*pp){
-        if((*pp)->pid == pid){
-            Job *removed_job = *pp;
-            *pp = removed_job->next;
-            if(out_cmd){
-                *out_cmd = removed_job->cmdline;
+/*
+Helper function to start argv[0] as a child process with posix_spawn(),
+with in_fd/out_fd (if not -1) as its stdin/stdout.
+glibc builds it on a vfork-style clone, so unlike fork() the shell's page
+tables (readline history, heap) are never copied and launch cost stays flat.
+SIGINT and SIGPIPE are put back to their defaults and the signal mask is
+cleared in the child via the spawn attributes, since the shell itself may
+ignore, catch or block them. Commands without a '/' are
+run from the path cache instead of letting execvp() try every $PATH entry;
+if the cached file has gone away the entry is dropped and $PATH searched
+again. Returns the child's pid, or -1 after printing an error if the
+command could not be started.
+*/
+static pid_t spawn_command(char **argv, int in_fd, int out_fd){
+    fflush(stdout); //builtin output so far comes before the child's
+    posix_spawnattr_t attr;
+    int err = posix_spawnattr_init(&attr);
+    if(err != 0){
+        fprintf(stderr, "posix_spawnattr_init: %s\n", strerror(err));
+        return -1;
+    }
+    sigset_t def;
+    sigemptyset(&def);
+    sigaddset(&def, SIGINT);
+    sigaddset(&def, SIGPIPE);
+    posix_spawnattr_setsigdefault(&attr, &def);
+    sigset_t none;
+    sigemptyset(&none);
+    posix_spawnattr_setsigmask(&attr, &none);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK);
+
+    //dup2() onto 0/1 clears close-on-exec, every other shell descriptor is O_CLOEXEC
+    posix_spawn_file_actions_t fa, *fap = NULL;
+    if(in_fd >= 0 || out_fd >= 0){
+        posix_spawn_file_actions_init(&fa);
+        if(in_fd >= 0){
+            posix_spawn_file_actions_adddup2(&fa, in_fd, STDIN_FILENO);
+        }
+        if(out_fd >= 0){
+            posix_spawn_file_actions_adddup2(&fa, out_fd, STDOUT_FILENO);
+        }
+        fap = &fa;
+    }
+
+    pid_t pid;
+    CmdPath *e = NULL;
+    if(strchr(argv[0], '/')){
+        err = posix_spawn(&pid, argv[0], fap, &attr, argv, environ);
+    }
+    else{
+        e = hash_lookup(argv[0]);
+        err = e ? posix_spawn(&pid, e->path, fap, &attr, argv, environ) : ENOENT;
+        if(err == ENOENT && e){
+            hash_forget(argv[0]);
+            e = hash_lookup(argv[0]);
+            err = e ? posix_spawn(&pid, e->path, fap, &attr, argv, environ) : ENOENT;
+        }
+        if(err == 0){
+            e->hits++;
+        }
+    }
+    posix_spawnattr_destroy(&attr);
+    if(fap){
+        posix_spawn_file_actions_destroy(fap);
+    }
+    if(err != 0){
+        fprintf(stderr, "%s: %s\n", argv[0], strerror(err));
+        return -1;
+    }
+    return pid;
+}
+
+//Pipelines: cmd [< in] | cmd | ... | cmd [> out]
+#define MAX_STAGES 64
+
+typedef struct {
+    char **stages[MAX_STAGES]; //NULL-terminated argv slices of the lexed line
+    int n_stages;
+    const char *in_path;       //'<' on the first command, or NULL
+    const char *out_path;      //'>' on the last command, or NULL
+} Pipeline;
+
+static int splice_mode = 0; //Relay data between stages and files through the shell with splice()
+static int last_status = 0; //Exit status of the last foreground command, ssi's own exit status in script mode
+
+/*
+Helper function to split a lexed line into pipeline stages in place.
+TOK_PIPE tokens become the NULL terminators of each stage, and "<"/">" and their
+file names are removed from the argv they appear in. Input redirection is
+only accepted on the first command and output redirection on the last.
+Returns 0 on success, -1 after printing a syntax error.
+*/
+static int parse_pipeline(char **argv, int argc, Pipeline *pl){
+    pl->n_stages = 0;
+    pl->in_path = NULL;
+    pl->out_path = NULL;
+    int out = 0;   //where the next kept word goes
+    int start = 0; //first word of the current stage
+    for(int i = 0; i <= argc; i++){
+        if(i == argc || argv[i] == TOK_PIPE){
+            if(out == start){
+                fprintf(stderr, "ssi: syntax error near '|'\n");
+                return -1;
+            }
+            if(pl->n_stages == MAX_STAGES){
+                fprintf(stderr, "ssi: too many commands in pipeline\n");
+                return -1;
+            }
+            if(i < argc && pl->out_path){
+                fprintf(stderr, "ssi: '>' is only allowed on the last command\n");
+                return -1;
+            }
+            argv[out] = NULL;
+            pl->stages[pl->n_stages++] = &argv[start];
+            start = ++out;
+            continue;
+        }
+        if(argv[i] == TOK_IN || argv[i] == TOK_OUT){
+            if(i + 1 == argc || argv[i+1] == TOK_PIPE || argv[i+1] == TOK_IN || argv[i+1] == TOK_OUT){
+                fprintf(stderr, "ssi: syntax error near '%s'\n", argv[i]);
+                return -1;
+            }
+            if(argv[i] == TOK_IN){
+                if(pl->n_stages > 0){
+                    fprintf(stderr, "ssi: '<' is only allowed on the first command\n");
+                    return -1;
+                }
+                pl->in_path = argv[++i];
             }
             else{
-                free(removed_job->cmdline);
+                pl->out_path = argv[++i];
             }
-            free(removed_job);
-            return 1;
+            continue;
         }
-        pp = &(*pp)->next;
+        argv[out++] = argv[i];
     }
     return 0;
 }
 
-static void print_bglist(void){
-    int count = 0;
-    for(Job *j = jobs_head; j; j = j->next){
-        printf("%d: %s\n", (int)j->pid, j->cmdline);
-        count++;
+//Helper to open a redirection target; the descriptor is never inherited as-is
+static int open_redirect(const char *path, int is_out){
+    int fd = is_out ? open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644) : open(path, O_RDONLY | O_CLOEXEC);
+    if(fd < 0){
+        fprintf(stderr, "ssi: %s: %s\n", path, strerror(errno));
     }
-    printf("Total Background jobs: %d\n", count);
+    return fd;
 }
 
-static char *join_argv(char **argv, int start, int argc){
-    size_t len = 0;
-    for(int i = start; i < argc; i++){
-        len += strlen(argv[i]) + 1;
-    }
-    char *s = (char*)malloc(len + 1);
-    if(!s){
-        perror("malloc");
-        exit(1);
+/*
+Splice mode: move everything from src to dst for each pair with splice(),
+so the data goes through the kernel's pipe buffers and never through a
+user-space buffer. Every descriptor is a pipe end the shell owns or a
+redirected file. A pair waits for input, or for room in dst once dst has
+filled up. It is closed on EOF, or when its reader goes away; closing the
+source then gives the writer EPIPE, as with a direct pipe.
+*/
+static void relay_loop(int (*pairs)[2], int n){
+    int live = n;
+    int full[MAX_STAGES + 1] = { 0 }; //dst had no room on the last try
+    while(live > 0){
+        struct pollfd pfd[2 * (MAX_STAGES + 1)];
+        for(int i = 0; i < n; i++){
+            pfd[2*i].fd = pairs[i][0];
+            pfd[2*i].events = full[i] ? 0 : POLLIN;
+            pfd[2*i+1].fd = pairs[i][1];
+            pfd[2*i+1].events = full[i] ? POLLOUT : 0; //POLLERR (reader gone) is always reported
+        }
+        if(poll(pfd, (nfds_t)(2 * n), -1) < 0){
+            if(errno == EINTR){
+                continue;
+            }
+            perror("poll");
+            break;
+        }
+        for(int i = 0; i < n; i++){
+            if(pairs[i][0] < 0){
+                continue;
+            }
+            short in = pfd[2*i].revents, outev = pfd[2*i+1].revents;
+            int done = (outev & POLLERR) != 0;
+            if(!done && (full[i] ? (outev & POLLOUT) : (in & (POLLIN | POLLHUP | POLLERR)))){
+                ssize_t m = splice(pairs[i][0], NULL, pairs[i][1], NULL, 1 << 16, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+                done = (m == 0) || (m < 0 && errno != EAGAIN && errno != EINTR);
+                //EAGAIN after input was ready means dst is full; after room was ready, src ran dry
+                if(m < 0 && errno == EAGAIN){
+                    full[i] = !full[i];
+                }
+                else if(m > 0){
+                    full[i] = 0;
+                }
+            }
+            if(done){
+                close(pairs[i][0]);
+                close(pairs[i][1]);
+                pairs[i][0] = pairs[i][1] = -1;
+                live--;
+            }
+        }
+        //Closed pairs are polled as fd -1, which poll() skips
     }
-    s[0] = '\0';
-    for(int i = start; i <argc; i++){
-        strcat(s, argv[i]);
-        if(i+1 < argc){
-            strcat(s, " ");
+    for(int i = 0; i < n; i++){
+        if(pairs[i][0] >= 0){
+            close(pairs[i][0]);
+            close(pairs[i][1]);
         }
     }
-    return s;
 }
 
-static void reap_background(void){
-    int status;
-    pid_t pid;
-    while((pid = waitpid(-1, &status, WNOHANG)) > 0){
-        char *cmd = NULL;
-        if(remove_job(pid, &cmd)){
-            printf("%d: %s has terminated.\n", (int)pid, cmd ? cmd : "");
-            fflush(stdout);
-            free(cmd);
+/*
+Helper function to start every stage of a pipeline. Adjacent stages are
+joined by a pipe and the redirected files are opened by the shell, then
+each stage is spawned with its stdin/stdout already in place. In splice
+mode each stage gets pipes to and from the shell instead, and relay_loop()
+moves the data across. Fills pids with one child per stage (-1 for a
+stage that could not be started) and returns how many stages were tried.
+*/
+static int start_pipeline(const Pipeline *pl, pid_t *pids){
+    int n = pl->n_stages;
+    int in_file = -1, out_file = -1;
+    if(pl->in_path && (in_file = open_redirect(pl->in_path, 0)) < 0){
+        return 0;
+    }
+    if(pl->out_path && (out_file = open_redirect(pl->out_path, 1)) < 0){
+        if(in_file >= 0){
+            close(in_file);
         }
+        return 0;
     }
-}
 
-static int builtin_bg(char **argv, int argc){
-    if(argc < 2){
-        return 1;
+    int pairs[MAX_STAGES + 1][2]; //splice mode: shell-side (src, dst) per relay
+    int n_pairs = 0;
+    int next_in = in_file;        //what the next stage reads from (-1: the terminal)
+    int relay_src = -1;           //splice mode: shell end of the previous stage's output
+    int started = 0;
+
+    if(splice_mode && in_file >= 0){
+        int p[2];
+        if(pipe2(p, O_CLOEXEC) == 0){
+            pairs[n_pairs][0] = in_file;
+            pairs[n_pairs][1] = p[1];
+            n_pairs++;
+            next_in = p[0];
+        }
     }
-    char *cmdline = join_argv(argv, 1, argc);
-    pid_t pid = fork();
-    if(pid < 0){
-        perror("fork");
-        free(cmdline);
-        return 1;
+    for(int i = 0; i < n; i++){
+        int cur_in = next_in;
+        int cur_out = (i == n - 1) ? out_file : -1;
+        next_in = -1;
+        int p[2] = { -1, -1 };
+        if(i < n - 1 || (splice_mode && out_file >= 0)){
+            if(pipe2(p, O_CLOEXEC) != 0){
+                perror("pipe");
+                if(cur_in >= 0 && cur_in != in_file){
+                    close(cur_in);
+                }
+                break;
+            }
+            cur_out = p[1];
+            if(splice_mode){
+                relay_src = p[0]; //shell reads what this stage writes
+            }
+            else{
+                next_in = p[0];
+            }
+        }
+        pids[started++] = spawn_command(pl->stages[i], cur_in, cur_out);
+        if(cur_in >= 0 && cur_in != in_file){
+            close(cur_in);
+        }
+        if(p[1] >= 0){
+            close(p[1]);
+        }
+        if(splice_mode && p[0] >= 0){
+            int q[2];
+            if(i == n - 1){
+                pairs[n_pairs][0] = relay_src;
+                pairs[n_pairs][1] = out_file;
+                out_file = -1; //the relay closes it
+                n_pairs++;
+            }
+            else if(pipe2(q, O_CLOEXEC) == 0){
+                pairs[n_pairs][0] = relay_src;
+                pairs[n_pairs][1] = q[1];
+                n_pairs++;
+                next_in = q[0];
+            }
+            else{
+                perror("pipe");
+                close(relay_src);
+            }
+        }
     }
-    else if(pid == 0){
-        //Child
-        struct sigaction sa;
-        sa.sa_handler = SIG_DFL;
-        sigemptyset(&sa.sa_mask);
-        sa.sa_flags = 0;
-        sigaction(SIGINT, &sa, NULL);
-        execvp(argv[1], &argv[1]);
-        fprintf(stderr, "%s: No such file or directory\n", argv[1]);
-        _exit(127);
+    if(next_in >= 0 && next_in != in_file){
+        close(next_in);
     }
-    else{ 
-        //Parent
-        add_job(pid, cmdline);
-        free(cmdline);
+    if(n_pairs > 0 && pairs[0][0] == in_file){
+        in_file = -1; //the relay closes it
     }
-    return 1;
+    if(in_file >= 0){
+        close(in_file);
+    }
+    if(out_file >= 0){
+        close(out_file);
+    }
+    if(n_pairs > 0){
+        //A reader that exits early must not take the shell down with SIGPIPE
+        struct sigaction oldpipe, ign;
+        ign.sa_handler = SIG_IGN;
+        sigemptyset(&ign.sa_mask);
+        ign.sa_flags = 0;
+        sigaction(SIGPIPE, &ign, &oldpipe);
+        for(int i = 0; i < n_pairs; i++){
+            fcntl(pairs[i][0], F_SETFL, fcntl(pairs[i][0], F_GETFL) | O_NONBLOCK);
+            fcntl(pairs[i][1], F_SETFL, fcntl(pairs[i][1], F_GETFL) | O_NONBLOCK);
+        }
+        relay_loop(pairs, n_pairs);
+        sigaction(SIGPIPE, &oldpipe, NULL);
+    }
+    return started;
 }
 
-static int builtin_bglist(char **argv, int argc){
-    (void)argv;
-    (void)argc;
-    print_bglist();
-    return 1;
-}
+/*
+Resource accounting. Children are collected with wait4() so their rusage
+is kept: fg_rusage adds up every foreground child (all pipeline stages,
+parallel items) for the time builtin, and background jobs keep theirs in
+the finished-job history shown by bglist -v.
+*/
+static struct rusage fg_rusage;
 
-static void sigint_prompt_handler(int signum){
-    (void)signum;
-    rl_replace_line("", 0);
-    write(STDOUT_FILENO, "\n", 1);
-    rl_on_new_line();
-    rl_redisplay();
+//Helper to add r into sum (CPU times and context switches add up, max RSS is the largest)
+static void add_rusage(struct rusage *sum, const struct rusage *r){
+    timeradd(&sum->ru_utime, &r->ru_utime, &sum->ru_utime);
+    timeradd(&sum->ru_stime, &r->ru_stime, &sum->ru_stime);
+    if(r->ru_maxrss > sum->ru_maxrss){
+        sum->ru_maxrss = r->ru_maxrss;
+    }
+    sum->ru_nvcsw += r->ru_nvcsw;
+    sum->ru_nivcsw += r->ru_nivcsw;
 }
 
+static double tv_seconds(const struct timeval *tv){
+    return (double)tv->tv_sec + (double)tv->tv_usec / 1e6;
+}
 
-int main(void){
-    using_history(); //initialize history library
+static double seconds_since(const struct timespec *t0){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)(now.tv_sec - t0->tv_sec) + (double)(now.tv_nsec - t0->tv_nsec) / 1e9;
+}
 
-    //CTRL + C
-    struct sigaction sa;
-    sa.sa_handler = sigint_prompt_handler;
-    sigemptyset(&sa.sa_mask);
-    sa.sa_flags = SA_RESTART;  // restart readline on signals
-    sigaction(SIGINT, &sa, NULL);
+// start_pipeline() to spawn each command of the line
+// Parent --> wait4() for every child to finish, adding its rusage to fg_rusage
+static void collect_job(pid_t pid, int status, const struct rusage *ru);
+static void report_pending(void);
 
-    for (;;) {
-        // Reap any finished background jobs before showing the prompt
-        reap_background();
+static void run_foreground(char **argv, int argc){
+    if(!argv || !argv[0]){
+        return;
+    }
+    Pipeline pl;
+    if(parse_pipeline(argv, argc, &pl) != 0){
+        last_status = 2;
+        return;
+    }
 
-        char *prompt = build_prompt();
-        char *line = readline(prompt);
-        free(prompt);
+    // parent temporarily ignores SIGINT so Ctrl-C goes to child only
+    struct sigaction oldint, ign;
+    ign.sa_handler = SIG_IGN;
+    sigemptyset(&ign.sa_mask);
+    ign.sa_flags = 0;
+    sigaction(SIGINT, &ign, &oldint);
 
-        // Ctrl+D (EOF) exits
-        if (line == NULL) {
-            printf("\n");
+    pid_t pids[MAX_STAGES];
+    int n = start_pipeline(&pl, pids);
+    last_status = (n == pl.n_stages) ? 127 : 1; //last command never started
+    int left = 0;
+    for(int i = 0; i < n; i++){
+        left += pids[i] >= 0;
+    }
+    //Any child: a bg job that exits meanwhile is collected now, at its exit time
+    while(left > 0){
+        int status;
+        struct rusage ru;
+        pid_t pid = wait4(-1, &status, 0, &ru);
+        if(pid == -1){
+            if(errno == EINTR){ //Interrupt
+                continue;
+            }
+            perror("wait4");
             break;
         }
-
-        trim(line);
-        if (*line == '\0') { // ignore empty lines
-            free(line);
+        int i = 0;
+        while(i < n && pids[i] != pid){
+            i++;
+        }
+        if(i == n){
+            collect_job(pid, status, &ru);
             continue;
         }
+        left--;
+        add_rusage(&fg_rusage, &ru);
+        if(i == pl.n_stages - 1){
+            last_status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+        }
+    }
+    sigaction(SIGINT, &oldint, NULL);
+    report_pending();
+}
+
+/*
+Event sources of the main loop, all in one epoll set: stdin (fed to
+readline one character at a time), a signalfd for SIGINT and SIGCHLD,
+and a pidfd per background job that becomes readable when the job exits.
+Each is identified by its epoll data: EV_STDIN, EV_SIGNAL, or a job's pid.
+*/
+#define EV_STDIN  0
+#define EV_SIGNAL ((uint64_t)-1)
+
+static int epfd = -1;
+static int prompt_active = 0; //readline's line handler is installed, a line may be half typed
+static int running = 1;
+
+//Helper to get a pidfd for a child, or -1 where the kernel has no pidfd_open()
+static int open_pidfd(pid_t pid){
+#ifdef SYS_pidfd_open
+    return (int)syscall(SYS_pidfd_open, pid, 0);
+#else
+    (void)pid;
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+/*
+Background Jobs - a pid-keyed hash table (chained, doubled when it gets
+as full as it has buckets) for O(1) lookup and removal when a job is
+reaped, plus a doubly linked list in start order for bglist.
+*/
+typedef struct Job{
+    pid_t pid;
+    char *cmdline;
+    int pidfd;               //in the epoll set; -1 if pidfd_open() failed
+    int group;               //0 for bg, else the parallel run waiting for it
+    struct timespec started; //CLOCK_MONOTONIC, for the wall time in bglist -v
+    struct Job *hnext;       //next in the same hash bucket
+    struct Job *prev, *next; //start order
+} Job;
+
+static Job **job_buckets = NULL;
+static size_t job_nbuckets = 0;     //power of two
+static size_t job_count = 0;
+static Job *jobs_oldest = NULL, *jobs_newest = NULL;
+static size_t jobs_without_pidfd = 0; //these are reaped on SIGCHLD instead
+
+static size_t job_slot(pid_t pid){
+    return ((size_t)pid * 2654435761u) & (job_nbuckets - 1);
+}
+
+//Helper to double the hash table (or create it)
+static void grow_jobs(void){
+    size_t n = job_nbuckets ? job_nbuckets * 2 : 64;
+    Job **b = (Job**)calloc(n, sizeof(Job*));
+    if(!b){
+        perror("calloc");
+        exit(1);
+    }
+    free(job_buckets);
+    job_buckets = b;
+    job_nbuckets = n;
+    for(Job *j = jobs_oldest; j; j = j->next){
+        size_t s = job_slot(j->pid);
+        j->hnext = job_buckets[s];
+        job_buckets[s] = j;
+    }
+}
+
+//Helper to add a background job; returns its record
+static Job* add_job(pid_t pid, const char *cmdline){
+    if(job_count >= job_nbuckets){
+        grow_jobs();
+    }
+    Job *j = (Job*)malloc(sizeof(Job));
+    if(!j){
+        perror("malloc");
+        exit(1);
+    }
+    j->pid = pid;
+    j->cmdline = strdup(cmdline ? cmdline : "");
+    j->group = 0;
+    clock_gettime(CLOCK_MONOTONIC, &j->started);
+    size_t s = job_slot(pid);
+    j->hnext = job_buckets[s];
+    job_buckets[s] = j;
+    j->prev = jobs_newest;
+    j->next = NULL;
+    if(jobs_newest){
+        jobs_newest->next = j;
+    }
+    else{
+        jobs_oldest = j;
+    }
+    jobs_newest = j;
+    job_count++;
+
+    j->pidfd = open_pidfd(pid);
+    if(j->pidfd >= 0){
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.u64 = (uint64_t)pid;
+        if(epoll_ctl(epfd, EPOLL_CTL_ADD, j->pidfd, &ev) != 0){
+            close(j->pidfd);
+            j->pidfd = -1;
+        }
+    }
+    if(j->pidfd < 0){
+        jobs_without_pidfd++;
+    }
+    return j;
+}
+
+static Job* find_job(pid_t pid){
+    if(job_nbuckets == 0){
+        return NULL;
+    }
+    for(Job *j = job_buckets[job_slot(pid)]; j; j = j->hnext){
+        if(j->pid == pid){
+            return j;
+        }
+    }
+    return NULL;
+}
+
+//Helper to remove a background job
+static int remove_job(pid_t pid, char **out_cmd){
+    if(job_nbuckets == 0){
+        return 0;
+    }
+    for(Job **pp = &job_buckets[job_slot(pid)]; *pp; pp = &(*pp)->hnext){
+        if((*pp)->pid == pid){
+            Job *removed_job = *pp;
+            *pp = removed_job->hnext;
+            if(removed_job->prev){
+                removed_job->prev->next = removed_job->next;
+            }
+            else{
+                jobs_oldest = removed_job->next;
+            }
+            if(removed_job->next){
+                removed_job->next->prev = removed_job->prev;
+            }
+            else{
+                jobs_newest = removed_job->prev;
+            }
+            job_count--;
+            if(removed_job->pidfd >= 0){
+                close(removed_job->pidfd); //also leaves the epoll set
+            }
+            else{
+                jobs_without_pidfd--;
+            }
+            if(out_cmd){
+                *out_cmd = removed_job->cmdline;
+            }
+            else{
+                free(removed_job->cmdline);
+            }
+            free(removed_job);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+Finished-job history: the last FINISHED_MAX jobs to exit, with their exit
+status, wall time and rusage from wait4(), oldest overwritten first.
+*/
+#define FINISHED_MAX 64
+
+typedef struct {
+    pid_t pid;
+    char *cmdline;
+    int status;        //as returned by wait4()
+    double real_s;     //wall time from spawn to reap, which follows the exit closely
+    struct rusage ru;
+    int reported;      //"has terminated" printed
+} FinishedJob;
+
+static FinishedJob finished_jobs[FINISHED_MAX];
+static unsigned long n_finished = 0; //total ever recorded
+static int n_unreported = 0;
+
+static void announce_job(FinishedJob *f);
+
+/*
+Helper function to move a reaped job from the job table into the history.
+Returns its history entry, or NULL if pid is not a job.
+*/
+static FinishedJob* finish_job(pid_t pid, int status, const struct rusage *ru){
+    Job *j = find_job(pid);
+    if(!j){
+        return NULL;
+    }
+    FinishedJob *f = &finished_jobs[n_finished++ % FINISHED_MAX];
+    if(f->cmdline && !f->reported){
+        announce_job(f); //about to be overwritten
+    }
+    free(f->cmdline);
+    f->pid = pid;
+    f->status = status;
+    f->real_s = seconds_since(&j->started);
+    f->ru = *ru;
+    f->reported = 1;
+    remove_job(pid, &f->cmdline);
+    return f;
+}
+
+static void print_bglist(void){
+    int count = 0;
+    for(Job *j = jobs_newest; j; j = j->prev){
+        printf("%d: %s\n", (int)j->pid, j->cmdline);
+        count++;
+    }
+    printf("Total Background jobs: %d\n", count);
+}
+
+/*
+bglist -v: one tab-separated row per job, running jobs (newest first)
+then the finished-job history (most recent first), with a header line.
+CPU, RSS and context switch columns are "-" until a job has been reaped.
+*/
+static void print_bglist_verbose(void){
+    int count = 0;
+    printf("pid\tstate\treal_s\tuser_s\tsys_s\tmaxrss_kb\tnvcsw\tnivcsw\tcommand\n");
+    for(Job *j = jobs_newest; j; j = j->prev){
+        printf("%d\trunning\t%.3f\t-\t-\t-\t-\t-\t%s\n", (int)j->pid, seconds_since(&j->started), j->cmdline);
+        count++;
+    }
+    unsigned long kept = n_finished < FINISHED_MAX ? n_finished : FINISHED_MAX;
+    for(unsigned long k = 1; k <= kept; k++){
+        const FinishedJob *f = &finished_jobs[(n_finished - k) % FINISHED_MAX];
+        char state[32];
+        if(WIFEXITED(f->status)){
+            snprintf(state, sizeof(state), "exit %d", WEXITSTATUS(f->status));
+        }
+        else{
+            snprintf(state, sizeof(state), "signal %d", WTERMSIG(f->status));
+        }
+        printf("%d\t%s\t%.3f\t%.3f\t%.3f\t%ld\t%ld\t%ld\t%s\n", (int)f->pid, state, f->real_s,
+               tv_seconds(&f->ru.ru_utime), tv_seconds(&f->ru.ru_stime),
+               f->ru.ru_maxrss, f->ru.ru_nvcsw, f->ru.ru_nivcsw, f->cmdline);
+    }
+    printf("Total Background jobs: %d\n", count);
+}
+
+//Join argv[start..argc) with spaces into a line arena string, in one pass
+static char *join_argv(char **argv, int start, int argc){
+    size_t len = 0;
+    for(int i = start; i < argc; i++){
+        len += strlen(argv[i]) + 1;
+    }
+    char *s = (char*)arena_alloc(len + 1);
+    char *p = s;
+    for(int i = start; i <argc; i++){
+        size_t n = strlen(argv[i]);
+        memcpy(p, argv[i], n);
+        p += n;
+        if(i+1 < argc){
+            *p++ = ' ';
+        }
+    }
+    *p = '\0';
+    return s;
+}
+
+/*
+Job completion messages can now arrive while a line is being typed: the
+visible line is cleared, the message printed, and the prompt and the
+untouched line buffer redrawn underneath it.
+*/
+static void announce_job(FinishedJob *f){
+    if(!f->reported){
+        f->reported = 1;
+        n_unreported--;
+    }
+    if(prompt_active){
+        rl_clear_visible_line();
+    }
+    printf("%d: %s has terminated.\n", (int)f->pid, f->cmdline ? f->cmdline : "");
+    fflush(stdout);
+    if(prompt_active){
+        rl_forced_update_display();
+    }
+}
+
+static void report_job(pid_t pid, int status, const struct rusage *ru){
+    FinishedJob *f = finish_job(pid, status, ru);
+    if(f){
+        announce_job(f);
+    }
+}
+
+/*
+A bg job reaped by run_foreground()'s wait: recorded now, so its wall
+time ends at its exit, but reported by report_pending() once the
+foreground command is done.
+*/
+static void collect_job(pid_t pid, int status, const struct rusage *ru){
+    FinishedJob *f = finish_job(pid, status, ru);
+    if(f){
+        f->reported = 0;
+        n_unreported++;
+    }
+}
+
+//Report collected jobs, oldest first
+static void report_pending(void){
+    unsigned long kept = n_finished < FINISHED_MAX ? n_finished : FINISHED_MAX;
+    for(unsigned long k = kept; k >= 1 && n_unreported > 0; k--){
+        FinishedJob *f = &finished_jobs[(n_finished - k) % FINISHED_MAX];
+        if(!f->reported){
+            announce_job(f);
+        }
+    }
+}
+
+//A job's pidfd became readable: collect that one child
+static void reap_job(pid_t pid){
+    int status;
+    struct rusage ru;
+    if(wait4(pid, &status, WNOHANG, &ru) > 0){
+        report_job(pid, status, &ru);
+    }
+}
+
+/*
+SIGCHLD arrived through the signalfd. Jobs with a pidfd are collected by
+reap_job(); only when some job has none (no pidfd_open() in the kernel)
+is every exited child reaped here. Foreground children never show up,
+since run_foreground() waits for them before the loop runs again.
+*/
+static void reap_background(void){
+    if(jobs_without_pidfd == 0){
+        return;
+    }
+    int status;
+    struct rusage ru;
+    pid_t pid;
+    while((pid = wait4(-1, &status, WNOHANG, &ru)) > 0){
+        report_job(pid, status, &ru);
+    }
+}
+
+static int builtin_bg(char **argv, int argc){
+    if(argc < 2){
+        return 1;
+    }
+    char *cmdline = join_argv(argv, 1, argc);
+    pid_t pid = spawn_command(&argv[1], -1, -1);
+    if(pid < 0){
+        return 1;
+    }
+    else{ 
+        //Parent
+        add_job(pid, cmdline); //copies the command line out of the arena
+    }
+    return 1;
+}
+
+/*
+parallel [-j N] command [args...] ::: item...
+Runs "command args... item" once per item with at most N of them (default:
+one per online CPU) alive at a time, starting the next as soon as one
+exits. The jobs go into the job table while they run; each is reported
+with its exit status as it finishes, then a summary. The shell waits for
+all of them, like any foreground command, and a job killed by Ctrl-C
+stops the rest from starting. Exit status: number of failed jobs (max 101).
+*/
+static int parallel_runs = 0;
 
-        add_history(line);
+static int builtin_parallel(char **argv, int argc){
+    long max_jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    int i = 1;
+    if(i < argc && strncmp(argv[i], "-j", 2) == 0){
+        const char *n = argv[i][2] ? argv[i] + 2 : (i + 1 < argc ? argv[++i] : NULL);
+        char *end = NULL;
+        max_jobs = n ? strtol(n, &end, 10) : 0;
+        if(!n || *end || max_jobs < 1){
+            max_jobs = 0;
+        }
+        i++;
+    }
+    int cmd = i, sep = i;
+    while(sep < argc && strcmp(argv[sep], ":::") != 0){
+        sep++;
+    }
+    if(max_jobs < 1 || sep == cmd || sep == argc){
+        fprintf(stderr, "parallel: usage: parallel [-j N] command [args...] ::: item...\n");
+        last_status = 2;
+        return 1;
+    }
+    int n_fixed = sep - cmd;
+    int n_items = argc - sep - 1;
+    char **job_argv = arena_alloc(sizeof(char*) * (size_t)(n_fixed + 2));
+    memcpy(job_argv, &argv[cmd], sizeof(char*) * (size_t)n_fixed);
+    job_argv[n_fixed + 1] = NULL;
 
-        // Tokenize into argv[]
-        char **argv = NULL;
-        int argc = tokenize(line, &argv);
+    // like run_foreground, Ctrl-C goes to the jobs only
+    struct sigaction oldint, ign;
+    ign.sa_handler = SIG_IGN;
+    sigemptyset(&ign.sa_mask);
+    ign.sa_flags = 0;
+    sigaction(SIGINT, &ign, &oldint);
 
-        // Builtins first; otherwise run in foreground
-        if (!handle_builtin(argv, argc)) {
-            run_foreground(argv);
+    int group = ++parallel_runs;
+    int next = 0, live = 0, failed = 0, interrupted = 0;
+    while(live > 0 || (next < n_items && !interrupted)){
+        while(live < max_jobs && next < n_items && !interrupted){
+            job_argv[n_fixed] = argv[sep + 1 + next++];
+            pid_t pid = spawn_command(job_argv, -1, -1);
+            if(pid < 0){
+                failed++;
+                continue;
+            }
+            add_job(pid, join_argv(job_argv, 0, n_fixed + 1))->group = group;
+            live++;
+        }
+        if(live == 0){
+            break;
         }
 
-        free(argv); // free argv array (tokens live inside 'line')
+        int status;
+        struct rusage ru;
+        pid_t pid = wait4(-1, &status, 0, &ru);
+        if(pid < 0){
+            if(errno == EINTR){
+                continue;
+            }
+            perror("wait4");
+            break;
+        }
+        Job *j = find_job(pid);
+        if(!j || j->group != group){
+            report_job(pid, status, &ru); //an ordinary bg job ended meanwhile
+            continue;
+        }
+        add_rusage(&fg_rusage, &ru);
+        if(WIFEXITED(status)){
+            printf("%d: %s exited with status %d\n", (int)pid, j->cmdline, WEXITSTATUS(status));
+        }
+        else{
+            printf("%d: %s killed by signal %d\n", (int)pid, j->cmdline, WTERMSIG(status));
+            interrupted |= WTERMSIG(status) == SIGINT;
+        }
+        failed += !(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+        fflush(stdout);
+        remove_job(pid, NULL); //reported above, and not a bg job for bglist -v
+        live--;
+    }
+    if(interrupted && next < n_items){
+        printf("parallel: interrupted, %d jobs not started\n", n_items - next);
+    }
+    printf("parallel: %d jobs, %d failed\n", n_items, failed);
+    fflush(stdout);
+    sigaction(SIGINT, &oldint, NULL);
+    last_status = failed > 101 ? 101 : failed;
+    return 1;
+}
+
+static int builtin_bglist(char **argv, int argc){
+    if(argc > 1 && strcmp(argv[1], "-v") == 0){
+        print_bglist_verbose();
+    }
+    else{
+        print_bglist();
+    }
+    return 1;
+}
+
+/*
+time command [args...] - run the rest of the line (builtin or external)
+and report to stderr, one "key value" per line: wall time, user and system
+CPU (the shell's own plus every foreground child's, from wait4()), the
+largest child RSS (the shell's if no child ran) and context switches.
+*/
+static int builtin_time(char **argv, int argc){
+    if(argc < 2){
+        fprintf(stderr, "time: usage: time command [args...]\n");
+        last_status = 2;
+        return 1;
+    }
+    struct timespec t0;
+    struct rusage self0, self1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    getrusage(RUSAGE_SELF, &self0);
+    memset(&fg_rusage, 0, sizeof(fg_rusage));
+
+    if(!handle_builtin(&argv[1], argc - 1)){
+        run_foreground(&argv[1], argc - 1);
+    }
+
+    double real_s = seconds_since(&t0);
+    getrusage(RUSAGE_SELF, &self1);
+    struct rusage total = fg_rusage;
+    struct timeval du, ds;
+    timersub(&self1.ru_utime, &self0.ru_utime, &du);
+    timersub(&self1.ru_stime, &self0.ru_stime, &ds);
+    timeradd(&total.ru_utime, &du, &total.ru_utime);
+    timeradd(&total.ru_stime, &ds, &total.ru_stime);
+    total.ru_nvcsw += self1.ru_nvcsw - self0.ru_nvcsw;
+    total.ru_nivcsw += self1.ru_nivcsw - self0.ru_nivcsw;
+    if(total.ru_maxrss == 0){
+        total.ru_maxrss = self1.ru_maxrss;
+    }
+    fprintf(stderr, "real %.6f\nuser %.6f\nsys %.6f\nmaxrss_kb %ld\nnvcsw %ld\nnivcsw %ld\n",
+            real_s, tv_seconds(&total.ru_utime), tv_seconds(&total.ru_stime),
+            total.ru_maxrss, total.ru_nvcsw, total.ru_nivcsw);
+    return 1;
+}
+
+/*
+hash         list cached commands with their hit counts and paths
+hash -r      forget every cached path
+hash name... look the commands up in $PATH and cache them
+*/
+static int builtin_hash(char **argv, int argc){
+    if(argc == 1){
+        int count = 0;
+        for(int b = 0; b < HASH_BUCKETS; b++){
+            for(CmdPath *e = cmd_hash[b]; e; e = e->next){
+                if(count++ == 0){
+                    printf("hits\tcommand\n");
+                }
+                printf("%4d\t%s\n", e->hits, e->path);
+            }
+        }
+        if(count == 0){
+            printf("hash: hash table empty\n");
+        }
+        return 1;
+    }
+    if(strcmp(argv[1], "-r") == 0){
+        hash_clear();
+        return 1;
+    }
+    for(int i = 1; i < argc; i++){
+        if(!strchr(argv[i], '/') && !hash_lookup(argv[i])){
+            fprintf(stderr, "hash: %s: not found\n", argv[i]);
+        }
+    }
+    return 1;
+}
+
+// splice [on|off] - show or set splice relay mode for pipelines
+static int builtin_splice(char **argv, int argc){
+    if(argc > 1 && strcmp(argv[1], "on") == 0){
+        splice_mode = 1;
+    }
+    else if(argc > 1 && strcmp(argv[1], "off") == 0){
+        splice_mode = 0;
+    }
+    else if(argc > 1){
+        fprintf(stderr, "splice: usage: splice [on|off]\n");
+        return 1;
+    }
+    printf("splice: %s\n", splice_mode ? "on" : "off");
+    return 1;
+}
+
+/*
+arena    - print the line arena counters, one "key: value" per line
+arena -r - zero them (e.g. after warm-up, to watch the steady state)
+heap_in_use is what malloc has handed out overall, so growth there between
+two snapshots shows allocations the arena does not cover.
+*/
+static int builtin_arena(char **argv, int argc){
+    if(argc > 1 && strcmp(argv[1], "-r") == 0){
+        memset(&arena_stats, 0, sizeof(arena_stats));
+        return 1;
+    }
+    size_t cap = 0;
+    for(ArenaChunk *c = arena_head; c; c = c->next){
+        cap += c->cap;
+    }
+    struct mallinfo2 mi = mallinfo2();
+    printf("lines: %lu\n", arena_stats.lines);
+    printf("allocs: %lu\n", arena_stats.allocs);
+    printf("bytes: %llu\n", arena_stats.bytes);
+    printf("peak_line_bytes: %zu\n", arena_stats.peak_line_bytes);
+    printf("chunk_mallocs: %lu\n", arena_stats.chunk_mallocs);
+    printf("capacity: %zu\n", cap);
+    printf("heap_in_use: %zu\n", mi.uordblks);
+    return 1;
+}
+
+/*
+Persistent history. Every interactive line is appended, newline-terminated,
+to $SSI_HISTFILE (default ~/.ssi_history) with a single O_APPEND write, so
+shells running side by side interleave whole lines. The file is mapped with
+mmap() instead of being read: startup only walks back from the end of the
+mapping for the HIST_LOAD newest lines given to readline (arrows, Ctrl-R),
+so it costs the same whatever the file size.
+
+The history builtin searches the whole file through a line index built
+lazily on first use and extended with whatever was appended since:
+offsets[] holds every line start in file order (the line number is the
+position) and sorted[] the same offsets ordered by line text, so a prefix
+search is a binary search. Substring search runs memmem() over the mapping.
+
+When the file grows past $SSI_HISTFILESIZE bytes (default HIST_FILESIZE) it
+is compacted: the newest half is copied to a temporary file that is renamed
+over it. Appends hold a shared flock() and compaction an exclusive one, so
+other shells do not append in between.
+*/
+#define HIST_LOAD      1000
+#define HIST_FILESIZE  (1L << 20)
+#define HIST_SHOW      16
+
+typedef struct {
+    int fd;               //-1 when there is no history file (or not opened yet)
+    int oflags;           //open() flags: read-write and created only at the prompt
+    char path[PATH_MAX];
+    off_t max_size;
+    const char *map;      //whole file, read-only
+    size_t map_len;
+    size_t *offsets;      //line starts, in file order
+    size_t *sorted;       //line starts, ordered by line text
+    size_t n_lines, cap_lines;
+    size_t indexed_len;   //bytes of map covered by the index
+} HistFile;
+
+static HistFile hist = { .fd = -1 };
+
+//Compare the lines starting at offsets a and b; '\n' sorts below every printable byte
+static int hist_linecmp(size_t a, size_t b){
+    const unsigned char *p = (const unsigned char *)hist.map + a;
+    const unsigned char *q = (const unsigned char *)hist.map + b;
+    while(*p == *q && *p != '\n'){
+        p++;
+        q++;
+    }
+    return (int)*p - (int)*q;
+}
+
+static int hist_offcmp(const void *a, const void *b){
+    return hist_linecmp(*(const size_t *)a, *(const size_t *)b);
+}
+
+static int hist_poscmp(const void *a, const void *b){
+    size_t x = *(const size_t *)a, y = *(const size_t *)b;
+    return (x > y) - (x < y);
+}
+
+//Length of the line starting at off, without its newline
+static size_t hist_linelen(size_t off){
+    const char *nl = memchr(hist.map + off, '\n', hist.map_len - off);
+    return nl ? (size_t)(nl - (hist.map + off)) : hist.map_len - off;
+}
+
+static void hist_drop_index(void){
+    free(hist.offsets);
+    free(hist.sorted);
+    hist.offsets = hist.sorted = NULL;
+    hist.n_lines = hist.cap_lines = hist.indexed_len = 0;
+}
+
+/*
+Helper function to (re)map the file after it changed size. The file only
+shrinks when some shell compacted it, which invalidates the index.
+Returns 0 on success, -1 on error.
+*/
+static int hist_remap(void){
+    struct stat st;
+    if(fstat(hist.fd, &st) != 0){
+        perror("history");
+        return -1;
+    }
+    size_t len = (size_t)st.st_size;
+    if(hist.map && len == hist.map_len){
+        return 0;
+    }
+    if(len < hist.indexed_len){
+        hist_drop_index();
+    }
+    if(hist.map){
+        munmap((void *)hist.map, hist.map_len);
+        hist.map = NULL;
+        hist.map_len = 0;
+    }
+    if(len == 0){
+        return 0;
+    }
+    void *m = mmap(NULL, len, PROT_READ, MAP_SHARED, hist.fd, 0);
+    if(m == MAP_FAILED){
+        perror("history: mmap");
+        return -1;
+    }
+    hist.map = m;
+    hist.map_len = len;
+    return 0;
+}
+
+/*
+Helper function to switch to the new file after another shell compacted
+this one: the old file is then unlinked, and our mapping and index would
+go on describing it. Called before every search and by hist_lock().
+Returns 0 when hist.fd is the current file, -1 if it could not be reopened.
+*/
+static int hist_follow(void){
+    struct stat st;
+    if(fstat(hist.fd, &st) != 0 || st.st_nlink != 0){
+        return 0;
+    }
+    int fd = open(hist.path, hist.oflags, 0600);
+    if(fd < 0){
+        return -1; //keep the old file rather than none
+    }
+    close(hist.fd);
+    hist.fd = fd;
+    hist_drop_index();
+    hist_remap();
+    return 0;
+}
+
+/*
+Helper function to flock() the current file: LOCK_SH to append, LOCK_EX to
+compact. A lock on a file that was compacted away while we waited for it
+excludes nothing, so it is dropped and taken again on the new file.
+Returns 0 with the lock held, -1 on error.
+*/
+static int hist_lock(int op){
+    for(;;){
+        if(hist_follow() != 0){
+            return -1;
+        }
+        if(flock(hist.fd, op) != 0){
+            if(errno == EINTR){
+                continue;
+            }
+            return -1;
+        }
+        struct stat st;
+        if(fstat(hist.fd, &st) == 0 && st.st_nlink != 0){
+            return 0;
+        }
+        flock(hist.fd, LOCK_UN);
+    }
+}
+
+/*
+Helper function to bring the line index up to date with the mapping. Only
+complete lines past indexed_len are scanned; their offsets are sorted on
+their own and merged into sorted[]. Returns 0 on success, -1 on error.
+*/
+static int hist_update_index(void){
+    if(hist.fd < 0){
+        return -1;
+    }
+    hist_follow();
+    if(hist_remap() != 0){
+        return -1;
+    }
+    size_t first_new = hist.n_lines;
+    size_t pos = hist.indexed_len;
+    const char *nl;
+    while(pos < hist.map_len && (nl = memchr(hist.map + pos, '\n', hist.map_len - pos))){
+        if(hist.n_lines == hist.cap_lines){
+            size_t cap = hist.cap_lines ? hist.cap_lines * 2 : 1024;
+            size_t *o = realloc(hist.offsets, cap * sizeof(*o));
+            size_t *s = o ? realloc(hist.sorted, cap * sizeof(*s)) : NULL;
+            if(!o || !s){
+                perror("history");
+                if(o){
+                    hist.offsets = o;
+                }
+                return -1;
+            }
+            hist.offsets = o;
+            hist.sorted = s;
+            hist.cap_lines = cap;
+        }
+        hist.offsets[hist.n_lines++] = pos;
+        pos = (size_t)(nl - hist.map) + 1;
+    }
+    hist.indexed_len = pos;
+
+    size_t n_new = hist.n_lines - first_new;
+    if(n_new == 0){
+        return 0;
+    }
+    size_t *added = malloc(n_new * sizeof(*added));
+    if(!added){
+        perror("history");
+        return -1;
+    }
+    memcpy(added, hist.offsets + first_new, n_new * sizeof(*added));
+    qsort(added, n_new, sizeof(*added), hist_offcmp);
+    //Merge from the back so sorted[] can be filled in place
+    size_t i = first_new, j = n_new, k = hist.n_lines;
+    while(j > 0){
+        if(i > 0 && hist_linecmp(hist.sorted[i - 1], added[j - 1]) > 0){
+            hist.sorted[--k] = hist.sorted[--i];
+        }
+        else{
+            hist.sorted[--k] = added[--j];
+        }
+    }
+    free(added);
+    return 0;
+}
+
+//Line number (1-based, file order) of the line starting at off
+static size_t hist_lineno(size_t off){
+    size_t lo = 0, hi = hist.n_lines;
+    while(lo < hi){
+        size_t mid = lo + (hi - lo) / 2;
+        if(hist.offsets[mid] < off){
+            lo = mid + 1;
+        }
+        else{
+            hi = mid;
+        }
+    }
+    return lo + 1;
+}
+
+static void hist_print(size_t off){
+    printf("%5zu  %.*s\n", hist_lineno(off), (int)hist_linelen(off), hist.map + off);
+}
+
+/*
+Helper function to compact the file to its newest half, starting at a line
+boundary. Runs with the file locked; the old file is replaced by rename()
+so a crash leaves one or the other intact.
+*/
+static void hist_compact(void){
+    if(hist_lock(LOCK_EX) != 0){
+        return;
+    }
+    if(hist_remap() != 0){ //whatever was appended before we got the lock
+        flock(hist.fd, LOCK_UN);
+        return;
+    }
+    if((off_t)hist.map_len <= hist.max_size){ //another shell got there first
+        flock(hist.fd, LOCK_UN);
+        return;
+    }
+    size_t start = hist.map_len - (size_t)hist.max_size / 2;
+    const char *nl = memchr(hist.map + start - 1, '\n', hist.map_len - start + 1);
+    start = nl ? (size_t)(nl - hist.map) + 1 : hist.map_len;
+
+    char tmp[PATH_MAX + 8];
+    snprintf(tmp, sizeof(tmp), "%s.XXXXXX", hist.path);
+    int fd = mkostemp(tmp, O_CLOEXEC);
+    if(fd < 0){
+        perror("history: compact");
+        flock(hist.fd, LOCK_UN);
+        return;
+    }
+    size_t done = start;
+    while(done < hist.map_len){
+        ssize_t w = write(fd, hist.map + done, hist.map_len - done);
+        if(w < 0 && errno == EINTR){
+            continue;
+        }
+        if(w <= 0){
+            break;
+        }
+        done += (size_t)w;
+        if(done == hist.map_len && hist_remap() != 0){ //copy through EOF
+            break;
+        }
+    }
+    fchmod(fd, 0600);
+    if(done != hist.map_len || rename(tmp, hist.path) != 0){
+        perror("history: compact");
+        close(fd);
+        unlink(tmp);
+        flock(hist.fd, LOCK_UN);
+        return;
+    }
+    close(fd);
+    int newfd = open(hist.path, O_RDWR | O_APPEND | O_CLOEXEC);
+    flock(hist.fd, LOCK_UN); //shells waiting on the old file find it unlinked in hist_lock()
+    if(newfd < 0){
+        perror(hist.path);
+        return;
+    }
+    close(hist.fd);
+    hist.fd = newfd;
+    hist_drop_index();
+    hist_remap();
+}
+
+/*
+Helper function to open and map the history file. The prompt opens it
+for appending, creating it if needed; scripts and -c only open an
+existing file for reading, on their first history builtin. History stays
+in memory only if the file cannot be opened.
+*/
+static void hist_open(int interactive){
+    const char *path = getenv("SSI_HISTFILE");
+    const char *home = getenv("HOME");
+    if(path && *path){
+        snprintf(hist.path, sizeof(hist.path), "%s", path);
+    }
+    else if(home && *home){
+        snprintf(hist.path, sizeof(hist.path), "%s/.ssi_history", home);
+    }
+    else{
+        return;
+    }
+    const char *size = getenv("SSI_HISTFILESIZE");
+    hist.max_size = (size && atol(size) > 0) ? atol(size) : HIST_FILESIZE;
+
+    hist.oflags = interactive ? O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC : O_RDONLY | O_CLOEXEC;
+    hist.fd = open(hist.path, hist.oflags, 0600);
+    if(hist.fd < 0){
+        if(interactive || errno != ENOENT){
+            perror(hist.path);
+        }
+        return;
+    }
+    hist_remap();
+}
+
+//Hand the newest HIST_LOAD complete lines of the file to readline, oldest first
+static void hist_load_recent(void){
+    if(!hist.map){
+        return;
+    }
+    const char *nl = memrchr(hist.map, '\n', hist.map_len);
+    if(!nl){
+        return;
+    }
+    size_t end = (size_t)(nl - hist.map) + 1; //a torn last line without its newline is left out
+    size_t start = end;
+    for(int n = 0; start > 0 && n < HIST_LOAD; n++){
+        nl = start > 1 ? memrchr(hist.map, '\n', start - 1) : NULL;
+        start = nl ? (size_t)(nl - hist.map) + 1 : 0;
+    }
+    for(size_t pos = start; pos < end;){
+        size_t len = hist_linelen(pos);
+        char *line = strndup(hist.map + pos, len);
+        if(line){
+            add_history(line);
+            free(line);
+        }
+        pos += len + 1;
+    }
+}
+
+/*
+Helper function to record one entered line: in readline's list, and
+appended to the history file unless it repeats the previous entry.
+*/
+static void hist_add(const char *line){
+    HIST_ENTRY *prev = history_get(history_base + history_length - 1);
+    if(prev && strcmp(prev->line, line) == 0){
+        return;
+    }
+    add_history(line);
+    if(hist.fd < 0){
+        return;
+    }
+    if(hist_lock(LOCK_SH) != 0){
+        perror("history");
+        return;
+    }
+    struct iovec iov[2] = {
+        { (void *)line, strlen(line) },
+        { "\n", 1 },
+    };
+    if(writev(hist.fd, iov, 2) < 0){
+        perror("history");
+        flock(hist.fd, LOCK_UN);
+        return;
+    }
+    struct stat st;
+    int full = fstat(hist.fd, &st) == 0 && st.st_size > hist.max_size;
+    flock(hist.fd, LOCK_UN); //compaction needs LOCK_EX, which flock() cannot upgrade to atomically
+    if(full){
+        hist_compact();
+    }
+}
+
+/*
+history [N]        - the last N lines of the history file (default HIST_SHOW)
+history -p prefix  - every distinct line starting with prefix, newest copy
+                     of each, in file order
+history -s text    - every line containing text, in file order
+Lines are numbered by their position in the file. The words after -p or
+-s are joined with single spaces.
+*/
+static int builtin_history(char **argv, int argc){
+    static int tried = 0;
+    if(hist.fd < 0 && !tried){
+        tried = 1;
+        hist_open(0); //not at the prompt: opened on first use, never created
+    }
+    if(hist.fd < 0){
+        fprintf(stderr, "history: no history file\n");
+        last_status = 1;
+        return 1;
+    }
+    if(hist_update_index() != 0){
+        last_status = 1;
+        return 1;
+    }
+    if(argc >= 3 && strcmp(argv[1], "-p") == 0){
+        const char *prefix = join_argv(argv, 2, argc);
+        size_t plen = strlen(prefix);
+        //lower bound of prefix among the sorted lines
+        size_t lo = 0, hi = hist.n_lines;
+        while(lo < hi){
+            size_t mid = lo + (hi - lo) / 2;
+            size_t off = hist.sorted[mid];
+            size_t len = hist_linelen(off);
+            int c = memcmp(hist.map + off, prefix, len < plen ? len : plen);
+            if(c < 0 || (c == 0 && len < plen)){
+                lo = mid + 1;
+            }
+            else{
+                hi = mid;
+            }
+        }
+        size_t *hits = NULL;
+        size_t n_hits = 0;
+        for(size_t i = lo; i < hist.n_lines; i++){
+            size_t off = hist.sorted[i];
+            if(hist_linelen(off) < plen || memcmp(hist.map + off, prefix, plen) != 0){
+                break;
+            }
+            //equal lines sit together; keep the newest (largest offset) copy
+            if(n_hits > 0 && hist_linecmp(hits[n_hits - 1], off) == 0){
+                if(off > hits[n_hits - 1]){
+                    hits[n_hits - 1] = off;
+                }
+                continue;
+            }
+            size_t *tmp = realloc(hits, (n_hits + 1) * sizeof(*hits));
+            if(!tmp){
+                perror("history");
+                break;
+            }
+            hits = tmp;
+            hits[n_hits++] = off;
+        }
+        qsort(hits, n_hits, sizeof(*hits), hist_poscmp); //back to file order
+        for(size_t i = 0; i < n_hits; i++){
+            hist_print(hits[i]);
+        }
+        free(hits);
+        last_status = n_hits ? 0 : 1;
+        return 1;
+    }
+    if(argc >= 3 && strcmp(argv[1], "-s") == 0){
+        const char *text = join_argv(argv, 2, argc);
+        size_t tlen = strlen(text);
+        size_t pos = 0, found = 0;
+        const char *hit;
+        while(tlen > 0 && pos < hist.indexed_len &&
+              (hit = memmem(hist.map + pos, hist.indexed_len - pos, text, tlen))){
+            const char *ls = memrchr(hist.map + pos, '\n', (size_t)(hit - (hist.map + pos)));
+            size_t off = ls ? (size_t)(ls - hist.map) + 1 : pos;
+            if(memchr(hit, '\n', tlen)){ //match spans a line break
+                pos = off + hist_linelen(off) + 1;
+                continue;
+            }
+            hist_print(off);
+            found++;
+            pos = off + hist_linelen(off) + 1;
+        }
+        last_status = found ? 0 : 1;
+        return 1;
+    }
+    long n = HIST_SHOW;
+    if(argc == 2 && argv[1][0] != '-'){
+        n = atol(argv[1]);
+    }
+    else if(argc != 1){
+        fprintf(stderr, "history: usage: history [N] | -p prefix | -s text\n");
+        last_status = 2;
+        return 1;
+    }
+    size_t first = (n >= 0 && (size_t)n < hist.n_lines) ? hist.n_lines - (size_t)n : 0;
+    for(size_t i = first; i < hist.n_lines; i++){
+        hist_print(hist.offsets[i]);
+    }
+    return 1;
+}
+
+//Ctrl-C at the prompt: drop the current line and start a fresh one
+static void prompt_sigint(void){
+    rl_callback_sigcleanup();
+    rl_replace_line("", 0);
+    write(STDOUT_FILENO, "\n", 1);
+    rl_on_new_line();
+    rl_redisplay();
+}
+
+//Run one command line of len bytes, the same way in every input mode; blank and comment lines do nothing
+static void run_line(char *line, size_t len){
+    // Lex into argv[]
+    char **argv = NULL;
+    int argc = lex_line(line, len, &argv);
+    if (argc <= 0) {
+        if (argc < 0) {
+            last_status = 2;
+        }
+        arena_reset();
+        return;
+    }
+
+    // Builtins first (status 0 unless they set one); otherwise run in foreground
+    last_status = 0;
+    if (!handle_builtin(argv, argc)) {
+        run_foreground(argv, argc);
+    }
+
+    arena_reset(); // argv and everything else this line allocated (tokens live inside 'line')
+}
+
+/*
+readline line handler, called from rl_callback_read_char() once a whole
+line has been entered (NULL on Ctrl-D). The handler is removed while the
+command runs; the main loop installs it again with a fresh prompt.
+*/
+static void on_line(char *line){
+    rl_callback_handler_remove();
+    prompt_active = 0;
+
+    // Ctrl+D (EOF) exits
+    if (line == NULL) {
+        printf("\n");
+        running = 0;
+        return;
+    }
+
+    size_t len = strlen(line);
+    size_t lead = strspn(line, " \t\r\n");
+    if (lead == len) { // ignore empty lines
         free(line);
+        return;
+    }
+    while (lex_blank(line[len - 1])) { // keep trailing blanks out of the history
+        line[--len] = '\0';
+    }
+
+    hist_add(line + lead);
+    run_line(line + lead, len - lead);
+    free(line);
+}
+
+/*
+Wait up to timeout ms (-1: forever) for events and handle them. Input is
+only passed to readline when read_input is set. Returns the number of
+events, or -1 on error.
+*/
+static int dispatch_events(int sigfd, int timeout, int read_input){
+    struct epoll_event evs[64];
+    int n = epoll_wait(epfd, evs, 64, timeout);
+    if (n < 0) {
+        if (errno == EINTR) {
+            return 0;
+        }
+        perror("epoll_wait");
+        return -1;
+    }
+    for (int i = 0; i < n && running; i++) {
+        if (evs[i].data.u64 == EV_STDIN) {
+            if (read_input && prompt_active) {
+                rl_callback_read_char();
+            }
+        }
+        else if (evs[i].data.u64 == EV_SIGNAL) {
+            struct signalfd_siginfo si;
+            while (read(sigfd, &si, sizeof si) == (ssize_t)sizeof si) {
+                if (si.ssi_signo == SIGINT && prompt_active) {
+                    prompt_sigint();
+                }
+                else if (si.ssi_signo == SIGCHLD) {
+                    reap_background();
+                }
+            }
+        }
+        else {
+            reap_job((pid_t)evs[i].data.u64);
+        }
+    }
+    return n;
+}
+
+/*
+Non-interactive input (a script file, or stdin that is not a terminal) is
+read in SCRIPT_BUF sized chunks and split into lines in place, with no
+prompt, no line editing and no history. Lines whose first word starts
+with '#' are comments, so a script can start with "#!/path/to/ssi".
+*/
+#define SCRIPT_BUF (1 << 16)
+
+typedef struct {
+    int fd;
+    char *buf;
+    size_t pos, len, cap; //next line starts at pos, data ends at len
+    int eof;
+} LineReader;
+
+/*
+Helper function to return the next line (without its '\n') from r, or
+NULL at the end of input. The line lives in r's buffer and stays valid
+until the next call.
+*/
+static char* next_line(LineReader *r, size_t *len){
+    for(;;){
+        char *nl = memchr(r->buf + r->pos, '\n', r->len - r->pos);
+        if(nl || (r->eof && r->pos < r->len)){
+            char *line = r->buf + r->pos;
+            if(nl){
+                *nl = '\0';
+                *len = (size_t)(nl - line);
+                r->pos = (size_t)(nl - r->buf) + 1;
+            }
+            else{
+                r->buf[r->len] = '\0'; //last line without a newline
+                *len = r->len - r->pos;
+                r->pos = r->len;
+            }
+            return line;
+        }
+        if(r->eof){
+            return NULL;
+        }
+
+        //Keep the partial line, make room and read more
+        memmove(r->buf, r->buf + r->pos, r->len - r->pos);
+        r->len -= r->pos;
+        r->pos = 0;
+        if(r->len + 1 >= r->cap){
+            char *tmp = realloc(r->buf, r->cap * 2);
+            if(!tmp){
+                perror("realloc");
+                exit(1);
+            }
+            r->buf = tmp;
+            r->cap *= 2;
+        }
+        ssize_t got = read(r->fd, r->buf + r->len, r->cap - r->len - 1);
+        if(got < 0 && errno == EINTR){
+            continue;
+        }
+        if(got < 0){
+            perror("read");
+        }
+        if(got <= 0){
+            r->eof = 1;
+        }
+        else{
+            r->len += (size_t)got;
+        }
+    }
+}
+
+//Run every line read from fd; background job exits are reported between lines
+static void run_script(int fd, int sigfd){
+    LineReader r = { fd, malloc(SCRIPT_BUF), 0, 0, SCRIPT_BUF, 0 };
+    if(!r.buf){
+        perror("malloc");
+        exit(1);
+    }
+    char *line;
+    size_t len;
+    while(running && (line = next_line(&r, &len)) != NULL){
+        run_line(line, len);
+        while(dispatch_events(sigfd, 0, 0) == 64){
+            continue;
+        }
+    }
+    free(r.buf);
+}
+
+static void usage(void){
+    fprintf(stderr, "Usage: ssi [-c command | script]\n");
+}
+
+int main(int argc, char **argv){
+    //ssi -c "command", ssi script, or stdin that is not a terminal: no prompt, no history
+    const char *command = NULL;
+    int script_fd = -1;
+    if (argc > 1 && strcmp(argv[1], "-c") == 0) {
+        if (argc != 3) {
+            usage();
+            return 2;
+        }
+        command = argv[2];
+    }
+    else if (argc == 2) {
+        script_fd = open(argv[1], O_RDONLY | O_CLOEXEC);
+        if (script_fd < 0) {
+            perror(argv[1]);
+            return 127;
+        }
+    }
+    else if (argc > 2) {
+        usage();
+        return 2;
+    }
+    else if (!isatty(STDIN_FILENO)) {
+        script_fd = STDIN_FILENO;
+    }
+    int interactive = !command && script_fd < 0;
+
+    //Background job exits (and at the prompt CTRL + C) are read from a signalfd instead of interrupting readline
+    sigset_t mask;
+    sigemptyset(&mask);
+    if (interactive) {
+        sigaddset(&mask, SIGINT);
+    }
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+    int sigfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if(sigfd < 0 || epfd < 0){
+        perror(sigfd < 0 ? "signalfd" : "epoll_create1");
+        return 1;
+    }
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.u64 = EV_SIGNAL;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, sigfd, &ev);
+
+    if (!interactive) {
+        if (command) {
+            char *line = strdup(command);
+            run_line(line, strlen(line));
+            free(line);
+        }
+        else {
+            run_script(script_fd, sigfd);
+        }
+        return last_status;
+    }
+
+    using_history(); //initialize history library
+    prompt_init();
+    hist_open(1);
+    hist_load_recent();
+    ev.data.u64 = EV_STDIN;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, STDIN_FILENO, &ev);
+    rl_catch_signals = 0; //SIGINT is blocked, readline has nothing to catch
+
+    while (running) {
+        if (!prompt_active) {
+            // Report jobs that ended while the last command ran before showing the prompt
+            while (dispatch_events(sigfd, 0, 0) == 64) {
+                continue;
+            }
+            rl_callback_handler_install(build_prompt(), on_line); //copies and prints the prompt
+            prompt_active = 1;
+        }
+        if (dispatch_events(sigfd, -1, 1) < 0) {
+            break;
+        }
+    }
+    if (prompt_active) {
+        rl_callback_handler_remove();
     }
     return 0;
 }
@@ -0,0 +1,347 @@
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/ptrace.h>
+
+/*
+    ssibench - benchmark harness for ssi.
+    For every workload it writes a script to a scratch directory and runs
+    ./ssi on it twice. In the timed run every line is wrapped in the time
+    builtin, whose "real" lines give the per-command latency. The second
+    run is unwrapped and traced with ptrace to count the syscalls ssi
+    itself makes (children are not traced). Each workload prints one
+    tab-separated row, in a fixed order, so the output of two commits can
+    be compared with diff.
+*/
+
+#define MAX_RUNS 16
+
+static char scratch[64]; //mkdtemp("/tmp/ssibench.XXXXXX")
+static char ssi_path[PATH_MAX];
+
+static void usage(const char *prog){
+    fprintf(stderr,
+        "Usage: %s [-n commands] [-w \"true builtins bg longargs\"] [-a args_per_line] [-S]\n"
+        "  -S  skip the traced run (syscall columns read -1)\n", prog);
+}
+
+/* Split a space separated list into words. Returns the word count. */
+static int split(char *s, char **out, int max){
+    int n = 0;
+    for(char *save = NULL, *tok = strtok_r(s, " ,", &save); tok && n < max; tok = strtok_r(NULL, " ,", &save)){
+        out[n++] = tok;
+    }
+    return n;
+}
+
+/*
+    Write the script for one workload with n commands. With timed set,
+    every command is wrapped in the time builtin. The bg workload ends
+    with a short sleep so that the last jobs are reaped before ssi exits.
+    Returns 0 on success, -1 on error or an unknown workload.
+*/
+static int write_script(const char *path, const char *workload, long n, long n_args, int timed){
+    FILE *f = fopen(path, "w");
+    if(!f){
+        perror(path);
+        return -1;
+    }
+    const char *pre = timed ? "time " : "";
+    int ok = 1;
+    for(long i = 0; i < n && ok; i++){
+        if(strcmp(workload, "true") == 0){
+            fprintf(f, "%s/bin/true\n", pre);
+        }
+        else if(strcmp(workload, "builtins") == 0){
+            //cd twice and list the (empty) job table, round robin
+            static const char *cmds[] = { "cd /tmp", "cd /", "bglist" };
+            fprintf(f, "%s%s\n", pre, cmds[i % 3]);
+        }
+        else if(strcmp(workload, "bg") == 0){
+            fprintf(f, "%sbg /bin/true\n", pre);
+        }
+        else if(strcmp(workload, "longargs") == 0){
+            fprintf(f, "%s/bin/true", pre);
+            for(long a = 0; a < n_args; a++){
+                fprintf(f, a % 4 == 3 ? " \"quoted arg %ld\"" : " argument%ld", a);
+            }
+            fputc('\n', f);
+        }
+        else{
+            fprintf(stderr, "ssibench: unknown workload %s\n", workload);
+            ok = 0;
+        }
+    }
+    if(ok && strcmp(workload, "bg") == 0){
+        fprintf(f, "sleep 0.1\n");
+    }
+    if(fclose(f) != 0){
+        perror(path);
+        return -1;
+    }
+    return ok ? 0 : -1;
+}
+
+/* Child side of run(): cwd in the scratch directory, stdout and stderr redirected */
+static void child_setup(const char *err_path){
+    if(chdir(scratch) != 0){
+        _exit(126);
+    }
+    int out = open("/dev/null", O_WRONLY);
+    int err = open(err_path ? err_path : "/dev/null", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(out >= 0){
+        dup2(out, STDOUT_FILENO);
+        close(out);
+    }
+    if(err >= 0){
+        dup2(err, STDERR_FILENO);
+        close(err);
+    }
+}
+
+/*
+    Run ssi on script with stderr sent to err_path. Fills *ru from wait4 and
+    returns the exit status, or -1 if ssi could not be run.
+*/
+static int run(const char *script, const char *err_path, struct rusage *ru){
+    pid_t pid = fork();
+    if(pid < 0){
+        perror("fork");
+        return -1;
+    }
+    if(pid == 0){
+        child_setup(err_path);
+        execl(ssi_path, ssi_path, script, (char*)NULL);
+        _exit(127);
+    }
+    int status;
+    while(wait4(pid, &status, 0, ru) == -1){
+        if(errno != EINTR){
+            perror("wait4");
+            return -1;
+        }
+    }
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+}
+
+/*
+    Run ssi on script under ptrace and count the syscalls it enters. Only
+    ssi is traced: the children it spawns are not. Returns -1 if ssi could
+    not be traced.
+*/
+static long count_syscalls(const char *script){
+    pid_t pid = fork();
+    if(pid < 0){
+        perror("fork");
+        return -1;
+    }
+    if(pid == 0){
+        child_setup(NULL);
+        if(ptrace(PTRACE_TRACEME, 0, NULL, NULL) != 0){
+            _exit(125);
+        }
+        execl(ssi_path, ssi_path, script, (char*)NULL);
+        _exit(127);
+    }
+    int status;
+    if(waitpid(pid, &status, 0) != pid || !WIFSTOPPED(status)){ //stopped at exec, or failed
+        return -1;
+    }
+    ptrace(PTRACE_SETOPTIONS, pid, NULL, (void*)(long)(PTRACE_O_TRACESYSGOOD | PTRACE_O_EXITKILL));
+    long calls = 0;
+    int in_call = 0, sig = 0;
+    for(;;){
+        if(ptrace(PTRACE_SYSCALL, pid, NULL, (void*)(long)sig) != 0){
+            perror("ptrace");
+            kill(pid, SIGKILL);
+            waitpid(pid, &status, 0);
+            return -1;
+        }
+        sig = 0;
+        if(waitpid(pid, &status, 0) != pid){
+            if(errno == EINTR){
+                continue;
+            }
+            return -1;
+        }
+        if(WIFEXITED(status) || WIFSIGNALED(status)){
+            break;
+        }
+        if(WSTOPSIG(status) == (SIGTRAP | 0x80)){
+            //Stops come in entry/exit pairs; count entries
+            in_call = !in_call;
+            calls += in_call;
+        }
+        else{
+            sig = WSTOPSIG(status); //pass real signals on
+        }
+    }
+    return calls;
+}
+
+static int cmp_double(const void *a, const void *b){
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+/* Nearest-rank percentile of n sorted samples */
+static double percentile(const double *v, long n, double q){
+    if(n == 0){
+        return -1.0;
+    }
+    long k = (long)(q * (double)n + 0.999999);
+    if(k < 1){
+        k = 1;
+    }
+    return v[k > n ? n - 1 : k - 1];
+}
+
+/* Mean of n samples, or -1 when there are none */
+static double mean(const double *v, long n){
+    if(n == 0){
+        return -1.0;
+    }
+    double sum = 0.0;
+    for(long i = 0; i < n; i++){
+        sum += v[i];
+    }
+    return sum / (double)n;
+}
+
+/*
+    Read the per-command wall times from the time builtin's output: one
+    "real <seconds>" line per command. Returns the sample count, in
+    microseconds, sorted.
+*/
+static long read_latencies(const char *path, double **out){
+    FILE *f = fopen(path, "r");
+    if(!f){
+        perror(path);
+        return 0;
+    }
+    long n = 0, cap = 1024;
+    double *v = malloc(cap * sizeof(*v));
+    char line[256];
+    while(v && fgets(line, sizeof line, f)){
+        if(strncmp(line, "real ", 5) != 0){
+            continue;
+        }
+        if(n == cap){
+            cap *= 2;
+            double *tmp = realloc(v, cap * sizeof(*v));
+            if(!tmp){
+                break;
+            }
+            v = tmp;
+        }
+        v[n++] = atof(line + 5) * 1e6;
+    }
+    fclose(f);
+    if(v){
+        qsort(v, n, sizeof(*v), cmp_double);
+    }
+    *out = v;
+    return v ? n : 0;
+}
+
+int main(int argc, char **argv){
+    char workloads_arg[256] = "true builtins bg longargs";
+    long n_cmds = 2000;
+    long n_args = 10000;
+    int trace = 1;
+
+    int opt;
+    while((opt = getopt(argc, argv, "n:w:a:Sh")) != -1){
+        switch(opt){
+            case 'n': n_cmds = atol(optarg); break;
+            case 'w': snprintf(workloads_arg, sizeof workloads_arg, "%s", optarg); break;
+            case 'a': n_args = atol(optarg); break;
+            case 'S': trace = 0; break;
+            default: usage(argv[0]); return 1;
+        }
+    }
+    if(n_cmds <= 0 || n_args < 0){
+        usage(argv[0]);
+        return 1;
+    }
+    char *workloads[MAX_RUNS];
+    int n_workloads = split(workloads_arg, workloads, MAX_RUNS);
+
+    if(!realpath("./ssi", ssi_path)){
+        fprintf(stderr, "ssibench: run from the directory holding ssi (make bench)\n");
+        return 1;
+    }
+    snprintf(scratch, sizeof scratch, "/tmp/ssibench.XXXXXX");
+    if(!mkdtemp(scratch)){
+        perror("mkdtemp");
+        return 1;
+    }
+    //Keep the benchmark away from the user's own history file
+    char hist_path[PATH_MAX];
+    snprintf(hist_path, sizeof hist_path, "%s/history", scratch);
+    setenv("SSI_HISTFILE", hist_path, 1);
+
+    printf("# ssibench commands=%ld args_per_line=%ld\n", n_cmds, n_args);
+    printf("workload\tcommands\twall_ms\tmean_us\tp50_us\tp90_us\tp99_us\tmax_us\tctx_switches\tpeak_rss_kb\tsyscalls\tsyscalls_per_cmd\n");
+    fflush(stdout);
+
+    int failed = 0;
+    for(int w = 0; w < n_workloads; w++){
+        //Long lines take a while to launch; a tenth as many keeps the run short
+        long n = strcmp(workloads[w], "longargs") == 0 ? (n_cmds + 9) / 10 : n_cmds;
+        char timed_path[PATH_MAX], plain_path[PATH_MAX], err_path[PATH_MAX];
+        snprintf(timed_path, sizeof timed_path, "%s/%s.timed.ssi", scratch, workloads[w]);
+        snprintf(plain_path, sizeof plain_path, "%s/%s.ssi", scratch, workloads[w]);
+        snprintf(err_path, sizeof err_path, "%s/%s.err", scratch, workloads[w]);
+        if(write_script(timed_path, workloads[w], n, n_args, 1) != 0 ||
+           write_script(plain_path, workloads[w], n, n_args, 0) != 0){
+            failed = 1;
+            continue;
+        }
+
+        struct rusage ru;
+        struct timespec t0, t1;
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        int rc = run(timed_path, err_path, &ru);
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        if(rc != 0){
+            fprintf(stderr, "ssibench: ssi failed on %s (status %d)\n", workloads[w], rc);
+            failed = 1;
+        }
+        double wall_ms = (double)(t1.tv_sec - t0.tv_sec) * 1e3 + (double)(t1.tv_nsec - t0.tv_nsec) / 1e6;
+
+        double *lat = NULL;
+        long n_lat = read_latencies(err_path, &lat);
+        if(n_lat != n){
+            fprintf(stderr, "ssibench: %s: %ld latency samples for %ld commands\n", workloads[w], n_lat, n);
+            failed = 1;
+        }
+        long calls = trace ? count_syscalls(plain_path) : -1;
+
+        printf("%s\t%ld\t%.1f\t%.1f\t%.1f\t%.1f\t%.1f\t%.1f\t%ld\t%ld\t%ld\t%.1f\n", workloads[w], n, wall_ms,
+               mean(lat, n_lat), percentile(lat, n_lat, 0.50), percentile(lat, n_lat, 0.90),
+               percentile(lat, n_lat, 0.99), n_lat ? lat[n_lat - 1] : -1.0,
+               ru.ru_nvcsw + ru.ru_nivcsw, ru.ru_maxrss,
+               calls, calls < 0 ? -1.0 : (double)calls / (double)n);
+        fflush(stdout);
+        free(lat);
+        unlink(timed_path);
+        unlink(plain_path);
+        unlink(err_path);
+    }
+
+    unlink(hist_path);
+    rmdir(scratch);
+    return failed;
+}
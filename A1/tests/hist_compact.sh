@@ -0,0 +1,87 @@
+#!/bin/sh
+# Appends to the history file must not be lost while another shell
+# compacts it. First flock(1) stands in for the compacting shell: it holds
+# the exclusive lock while it renames a new file over the old one, and a
+# line typed meanwhile must end up in the new file. Then two shells append
+# to one small file at once, so it is compacted over and over under the
+# other one. Compaction keeps the newest lines, so what is left of each
+# shell's lines must be an unbroken run, and the file must end with the
+# last line of one of them; a gap is an append lost to the old file.
+# The shells need a terminal for the prompt, which script(1) provides.
+# Run from A1 (make test).
+set -eu
+
+SSI=$(pwd)/ssi
+N=${N:-1500}
+tmp=$(mktemp -d /tmp/ssitest.XXXXXX)
+trap 'rm -rf "$tmp"' EXIT
+fail=0
+
+# start_shell NAME SIZE: run ssi at a prompt on the lines in $tmp/NAME.in,
+# appending to $tmp/history; its pid goes in $shell_NAME, the feeder's in
+# $feed_NAME
+start_shell() {
+    rm -f "$tmp/$1.fifo"
+    mkfifo "$tmp/$1.fifo"
+    SSI_HISTFILE="$tmp/history" SSI_HISTFILESIZE=$2 \
+        timeout 120 script -qec "$SSI" /dev/null < "$tmp/$1.fifo" > /dev/null 2>&1 &
+    eval "shell_$1=\$!"
+    # script(1) stalls at the end of its input, so the fifo stays open
+    # and Ctrl-D is repeated until the shell has ended: one typed while
+    # readline has the terminal in cooked mode can be swallowed
+    { cat "$tmp/$1.in"; while printf '\004'; do sleep 1; done; } > "$tmp/$1.fifo" 2>/dev/null &
+    eval "feed_$1=\$!"
+}
+
+printf 'cd . old\n' > "$tmp/history"
+flock -x "$tmp/history" -c "touch '$tmp/locked'; sleep 1; printf 'cd . kept\n' > '$tmp/new'; mv '$tmp/new' '$tmp/history'" &
+locker=$!
+while [ ! -e "$tmp/locked" ]; do
+    sleep 0.1
+done
+echo "cd . typed" > "$tmp/c.in"
+start_shell c 1048576
+wait "$shell_c" "$locker" || true
+kill "$feed_c" 2>/dev/null || true
+if ! grep -q '^cd \. typed$' "$tmp/history"; then
+    echo "FAIL: a line typed during compaction went to the old file"
+    fail=1
+fi
+
+for shell in a b; do
+    i=1
+    while [ "$i" -le "$N" ]; do
+        echo "cd . $shell $i"
+        i=$((i + 1))
+    done > "$tmp/$shell.in"
+done
+
+for round in 1 2 3; do
+    rm -f "$tmp/history"
+    start_shell a 4096
+    start_shell b 4096
+    wait "$shell_a" "$shell_b" || true
+    kill "$feed_a" "$feed_b" 2>/dev/null || true
+    awk -v n="$N" -v round="$round" '
+        $1 == "cd" && $2 == "." { got[$3] = got[$3] " " $4; last = $4 }
+        END {
+            if (last != n) {
+                printf "FAIL round %d: the file ends at line %d, not %d\n", round, last, n
+                bad = 1
+            }
+            for (s in got) {
+                k = split(got[s], v, " ")
+                for (i = 2; i <= k; i++) {
+                    if (v[i] != v[i - 1] + 1) {
+                        printf "FAIL round %d: shell %s line %d missing\n", round, s, v[i - 1] + 1
+                        bad = 1
+                        break
+                    }
+                }
+            }
+            exit bad
+        }' "$tmp/history" || fail=1
+done
+
+[ "$fail" -eq 0 ] && echo "hist_compact: ok"
+exit "$fail"
@@ -0,0 +1,151 @@
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <getopt.h>
+
+/*
+    gen - synthetic workload generator for mts.
+    Writes train lines in the input.txt format ("<dir> <loading> <crossing>")
+    to stdout, with a configurable train count, direction/priority mix and
+    loading/crossing time distributions.
+*/
+
+/* Time distribution, always clamped to the 1..99 range mts accepts */
+typedef struct {
+    char kind;  //'c' constant, 'u' uniform, 'e' exponential, 'n' normal
+    double a;   //constant value, uniform low, exponential mean, normal mean
+    double b;   //uniform high, normal standard deviation
+} dist_t;
+
+static unsigned long long rng_state = 88172645463325252ULL;
+
+/* xorshift64* - small, fast and reproducible for a given --seed */
+static unsigned long long rng_next(void){
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 2685821657736338717ULL;
+}
+
+/* Uniform double in [0, 1) */
+static double rng_unit(void){
+    return (double)(rng_next() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/*
+    Parse "c:V", "u:LO:HI", "e:MEAN" or "n:MEAN:SD".
+    Returns 0 on success, -1 on a malformed spec.
+*/
+static int parse_dist(const char *spec, dist_t *d){
+    char kind;
+    double a = 0, b = 0;
+    int got = sscanf(spec, "%c:%lf:%lf", &kind, &a, &b);
+    switch(kind){
+        case 'c': case 'e':
+            if(got < 2){
+                return -1;
+            }
+            break;
+        case 'u': case 'n':
+            if(got < 3){
+                return -1;
+            }
+            break;
+        default:
+            return -1;
+    }
+    d->kind = kind;
+    d->a = a;
+    d->b = b;
+    return 0;
+}
+
+static int sample(const dist_t *d){
+    double v = d->a;
+    switch(d->kind){
+        case 'u':
+            v = d->a + rng_unit() * (d->b - d->a + 1.0);
+            break;
+        case 'e':
+            v = 1.0 - d->a * log(1.0 - rng_unit());
+            break;
+        case 'n': {
+            //Box-Muller
+            double u1 = rng_unit(), u2 = rng_unit();
+            v = d->a + d->b * sqrt(-2.0 * log(1.0 - u1)) * cos(6.283185307179586 * u2);
+            break;
+        }
+        default:
+            break;
+    }
+    int iv = (int)v;
+    if(iv < 1){
+        iv = 1;
+    }
+    if(iv > 99){
+        iv = 99;
+    }
+    return iv;
+}
+
+static void usage(const char *prog){
+    fprintf(stderr,
+        "Usage: %s [-n trains] [-s seed] [-E east_fraction] [-H high_fraction]\n"
+        "          [-l loading_dist] [-c crossing_dist]\n"
+        "Distributions: c:V  u:LO:HI  e:MEAN  n:MEAN:SD  (clamped to 1..99)\n"
+        "Defaults: -n 100 -s 1 -E 0.5 -H 0.5 -l u:1:99 -c u:1:99\n", prog);
+}
+
+int main(int argc, char **argv){
+    long n = 100;
+    unsigned long long seed = 1;
+    double east = 0.5, high = 0.5;
+    dist_t load = { 'u', 1, 99 }, cross = { 'u', 1, 99 };
+
+    int opt;
+    while((opt = getopt(argc, argv, "n:s:E:H:l:c:h")) != -1){
+        switch(opt){
+            case 'n': n = atol(optarg); break;
+            case 's': seed = strtoull(optarg, NULL, 10); break;
+            case 'E': east = atof(optarg); break;
+            case 'H': high = atof(optarg); break;
+            case 'l':
+                if(parse_dist(optarg, &load) != 0){
+                    fprintf(stderr, "Bad loading distribution: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'c':
+                if(parse_dist(optarg, &cross) != 0){
+                    fprintf(stderr, "Bad crossing distribution: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            default: usage(argv[0]); return 1;
+        }
+    }
+    if(n < 0 || east < 0 || east > 1 || high < 0 || high > 1){
+        usage(argv[0]);
+        return 1;
+    }
+
+    //Seed 0 would leave xorshift stuck at zero
+    rng_state ^= seed * 0x9E3779B97F4A7C15ULL;
+    if(rng_state == 0){
+        rng_state = 1;
+    }
+
+    static char buf[1 << 16];
+    setvbuf(stdout, buf, _IOFBF, sizeof buf);
+    for(long i = 0; i < n; i++){
+        int is_east = rng_unit() < east;
+        int is_high = rng_unit() < high;
+        char c = is_east ? (is_high ? 'E' : 'e') : (is_high ? 'W' : 'w');
+        int l = sample(&load);
+        int x = sample(&cross);
+        printf("%c %d %d\n", c, l, x);
+    }
+    return fflush(stdout) == 0 ? 0 : 1;
+}
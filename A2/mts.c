@@ -1,3 +1,4 @@
+#define _GNU_SOURCE   //pthread_attr_setaffinity_np, CPU_SET
 #define _DEFAULT_SOURCE
 #define _XOPEN_SOURCE 700
 #include <stdint.h>   
@@ -7,7 +8,42 @@
 #include <pthread.h>
 #include <unistd.h>
 #include <time.h>
-#include <stdarg.h>
+#include <getopt.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <dirent.h>
+
+/* One loading/crossing unit from the input file is a tenth of a second */
+#define TENTH_NS 100000000LL
+
+/* Async logger ring: slot count must be a power of two */
+#define LOG_RING_SLOTS 4096
+#define LOG_LINE_MAX   112  //Longest formatted log line
+#define LOG_BATCH      256
+
+/* --trace file: header magic and format version (records are host byte order) */
+#define TRACE_MAGIC   "MTSTRACE"
+#define TRACE_VERSION 1
+
+/* Upper bound for --tracks */
+#define MAX_TRACKS 64
+
+/* Upper bound for --convoy-max: trains sharing one track in a convoy */
+#define MAX_CONVOY 16
+
+/* Metrics histograms: log-linear (HDR style) buckets, 16 per power of two */
+#define HIST_SUB_BITS 4
+
+/* Input loader: --parse-threads bound and the smallest chunk worth a thread */
+#define MAX_PARSE_THREADS 64
+#define MIN_PARSE_CHUNK   (1 << 16)
 
 /* Directions in which the train is travelling (East/West) */
 typedef enum {
@@ -15,8 +51,12 @@ typedef enum {
     WEST = 1
 } direction_t; 
 
+/* Simulation context, defined below once its member types are */
+typedef struct sim sim_t;
+
 /* Train Object - (Parsed from the input and used by train thread + dispatcher) */
 typedef struct {
+    sim_t *sim;           //Scenario this train belongs to
     int id;           
     direction_t dir; 
     int high_priority; 
@@ -24,405 +64,2230 @@ typedef struct {
     int crossing_time;   
     int64_t ready_time_ns; 
     pthread_t tid;      
-    pthread_cond_t cv; 
-    int my_turn;       
+    sem_t go;             //Posted by the dispatcher when it is this train's turn
+    int inbox_next;       //Next train in the same class inbox, -1 at the end
+    int track;            //Track assigned by the dispatcher
+    int64_t on_deadline_ns;  //Simulated time this train may enter its track
+    int64_t off_deadline_ns; //Simulated time this train must leave its track
+    int64_t on_ns, off_ns;   //Simulated times it was logged ON / OFF (for --metrics)
 } train_t;
 
-/*Linked List Node to build Ready Queues*/
-typedef struct ready_node{
+/* Log events, in the order a train goes through them */
+typedef enum {
+    EV_READY = 0,
+    EV_ON = 1,
+    EV_OFF = 2
+} event_t;
+
+/*Direction-balancing State - consulted by the policy's chooser, advanced when a train leaves a track*/
+typedef struct {
+    int have_ever_crossed;
+    direction_t last_dir;
+    int same_dir_streak;
+    int64_t wfq_vtime[2]; //--policy wfq: weighted service each direction has received
+} sched_state_t;
+
+/*Main Track*/
+typedef struct {
+    int occupants;       //Trains dispatched onto it that have not left yet (0 = free)
+    direction_t dir;     //Direction of those trains
+    int64_t last_on_ns;  //Simulated time the last of them enters (--convoy headway)
+    int64_t free_at_ns;  //Simulated time the last train scheduled on it leaves
+    sched_state_t rules; //Only used with --track-rules per-track
+} track_t;
+
+/*
+    Log Record - one event as 16 fixed bytes. Every event goes through the
+    log ring as one of these and the writer turns it into an output.txt
+    line. A --trace file is a trace_header followed by the records as they
+    are, in the order they were logged; mtstrace renders and diffs them.
+*/
+typedef struct {
+    int64_t ns;         //Simulated time since start
+    int32_t id;         //Train
+    uint8_t event;      //event_t
+    uint8_t dir;        //direction_t
+    uint8_t track;
+    uint8_t high;       //1 for a high-priority train
+} log_rec;
+
+typedef struct {
+    char magic[8];      //TRACE_MAGIC, not NUL-terminated
+    uint16_t version;   //TRACE_VERSION
+    uint16_t rec_size;  //sizeof(log_rec)
+    uint16_t n_tracks;  //Track numbers are printed when this is more than 1
+    uint16_t reserved;
+} trace_header;
+
+/*Timestamp Prefix Cache - "HH:MM:SS." for the second the last formatted line fell in*/
+typedef struct {
+    int64_t sec_ns;   //Start of that second
+    size_t hms_len;   //0 until the first line, so a zeroed cache is ready to use
+    char hms[32];
+} stamp_cache;
+
+/*Input Chunk - one contiguous run of whole lines, parsed independently by parse_chunk*/
+typedef struct {
+    const char *begin, *end;
+    train_t *trains;        //Trains parsed from this chunk (grown geometrically)
+    int n, cap;
+    int lines;              //Lines seen in the chunk
+    int err_line;           //Chunk-relative line of the first bad line, 0 if none
+    const char *err_text;
+    int blank_line;         //First of the blank lines ending the chunk, 0 if none
+    const char *blank_text;
+    int nomem;
+} parse_chunk_t;
+
+/*Batch Run - input files shared by the --batch worker pool, claimed in order*/
+typedef struct {
+    char **inputs;
+    int n;
+    atomic_int next;        //Next input to claim
+    atomic_int failed;      //Scenarios that returned an error
+} batch_t;
+
+/*Ready Queue Entry*/
+typedef struct {
     int idx;
     int64_t ready_ns;
-    struct ready_node *next;
-} ready_node;
-
-static struct timespec start; //Start Time 
-static train_t *trains = NULL; //Pointer to train array (Dynamic Allocation)
-static int n_trains = 0; //Number of trains in the array
-
-static pthread_mutex_t output_mutex = PTHREAD_MUTEX_INITIALIZER; //For writing to output to prevent lines from getting mixed
-static FILE *outf = NULL; //Output File 
-static pthread_mutex_t scheduling_mutex = PTHREAD_MUTEX_INITIALIZER; //Shared Scheduling state (ready queues, track state, counters)
-static pthread_cond_t ready_cv = PTHREAD_COND_INITIALIZER; //Signalled when train is ready to move or the track is free (Dispatcher waits for this)
-
-/*Queues*/
-static ready_node *east_high = NULL;
-static ready_node *east_low = NULL;
-static ready_node *west_high = NULL;
-static ready_node *west_low = NULL;
-
-/*Track Status*/
-static int track_in_use = 0;
-static int trains_finished = 0;
-static int have_ever_crossed = 0;
-static direction_t last_dir = EAST; //Arbitrary Value
-static int same_dir_streak = 0;
+    int64_t key;      //Leading sort key for policies that order by something other than ready time
+} ready_entry;
+
+/*Ready Queue - binary min-heap ordered by entry_before, storage carved from ready_pool*/
+typedef struct {
+    ready_entry *heap;
+    int size;
+    int cap;
+} ready_queue;
+
+/*
+    Scheduling Policy - picks the next train for a track out of the ready
+    queues. fcfs is the assignment's rule set; the others swap part of it.
+*/
+typedef struct {
+    const char *name;
+    int (*choose)(sim_t *sim, sched_state_t *st);
+    int key_by_crossing; //Order each queue by crossing_time before ready time
+    int promotes;        //Moves aged low-priority trains into the high queues
+} policy_t;
+
+enum { POLICY_FCFS, POLICY_SJF, POLICY_WFQ, POLICY_AGING };
+
+static int choose_next_idx_full(sim_t *sim, sched_state_t *st);
+static int choose_wfq(sim_t *sim, sched_state_t *st);
+static int choose_aging(sim_t *sim, sched_state_t *st);
+
+static const policy_t policies[] = {
+    [POLICY_FCFS]  = { "fcfs",  choose_next_idx_full, 0, 0 },
+    [POLICY_SJF]   = { "sjf",   choose_next_idx_full, 1, 0 },
+    [POLICY_WFQ]   = { "wfq",   choose_wfq,           0, 0 },
+    [POLICY_AGING] = { "aging", choose_aging,         0, 1 },
+};
+
+/*
+    Building with -DMTS_POLICY=POLICY_<NAME> pins the policy at compile time:
+    CHOOSE_NEXT becomes a direct call and the policy flags fold to constants.
+    Otherwise --policy selects one at run time, and the default still gets a
+    direct (inlinable) call to choose_next_idx_full behind one predictable test.
+    KEY_BY_CROSSING is read the same way, once per queue operation: each heap
+    loop is compiled for both orderings, so no comparison inside it looks at
+    the policy.
+*/
+#ifdef MTS_POLICY
+static const policy_t *const policy = &policies[MTS_POLICY];
+#define CHOOSE_NEXT(sim, st) (policies[MTS_POLICY].choose(sim, st))
+#define KEY_BY_CROSSING      (policies[MTS_POLICY].key_by_crossing)
+#else
+static const policy_t *policy = &policies[POLICY_FCFS];
+#define CHOOSE_NEXT(sim, st) (__builtin_expect(policy->choose == choose_next_idx_full, 1) \
+                              ? choose_next_idx_full(sim, st) : policy->choose(sim, st))
+#define KEY_BY_CROSSING      (__builtin_expect(policy->key_by_crossing, 0))
+#endif
+
+/*
+    Simulation Context - everything one scenario changes while it runs. The
+    run options below are parsed once and only read afterwards, so --batch
+    can run several contexts side by side, each with its own output file.
+*/
+struct sim {
+    const char *input;      //Input file, for messages
+    const char *out_path;   //Log file this scenario writes
+    struct timespec start;  //Start Time
+    train_t *trains;        //Pointer to train array (Dynamic Allocation)
+    int n_trains;           //Number of trains in the array
+
+    pthread_mutex_t output_mutex;     //--sync-log only: each event's time is read and its line written under it
+    FILE *outf;                       //Output File
+    pthread_mutex_t scheduling_mutex; //Shared Scheduling state (ready queues, track state, counters)
+    pthread_cond_t ready_cv;          //Signalled when train is ready to move or the track is free (Dispatcher waits for this)
+    pthread_cond_t work_cv;           //Signalled when a dispatched train is waiting for a crossing worker (--timer-thread)
+
+    /*Inboxes - lock-free MPSC stacks of newly ready train IDs per class (dir * 2 + high), -1 when empty*/
+    atomic_int inbox[4];
+    atomic_int dispatcher_idle; //Dispatcher is (about to be) waiting for ready trains
+
+    /*Queues*/
+    ready_entry *ready_pool; //One slot per train, split between the four queues
+    ready_queue east_high;
+    ready_queue east_low;
+    ready_queue west_high;
+    ready_queue west_low;
+
+    /*Track Status*/
+    track_t tracks[MAX_TRACKS];
+    int free_tracks;
+    int trains_finished;
+    sched_state_t global_rules;
+
+    /*Scheduler Counters (--metrics), protected by scheduling_mutex*/
+    long streak_rule_fired;    //Two-in-a-row rule sent a train the other way
+    long streak_rule_skipped;  //Rule applied but nobody was waiting the other way
+    long convoy_followers;     //Trains that joined a convoy behind another train
+
+    /*Async Logger State*/
+    log_rec *log_ring;            //Records kept contiguous so a --trace batch is written in place
+    atomic_size_t *log_seq;       //Per-record turn numbers: whose turn it is to touch that slot
+    atomic_size_t log_head;       //Next ticket handed to a producer
+    size_t log_tail;              //Next slot the writer drains (writer thread only)
+    atomic_int log_writer_idle;   //Writer is (about to be) asleep on log_wake
+    atomic_int log_stop;          //Set once all producers are done
+    sem_t log_wake;
+    pthread_t log_writer_tid;
+    stamp_cache sync_stamps;      //--sync-log prefix cache, protected by output_mutex
+
+    int64_t virtual_now_ns;       //Simulated clock of the --virtual-time engine
+
+    /*Crossing Work Queue (--timer-thread) - dispatched trains waiting for a worker, protected by scheduling_mutex*/
+    int *work_queue;
+    int work_head, work_tail;
+};
+
+/*Run Options*/
+static int virtual_time = 0; //Replay the schedule on a simulated clock instead of sleeping
+static int sync_log = 0;     //Write each line directly under output_mutex instead of via the writer thread
+static int n_tracks = 1;     //Parallel main tracks
+static int per_track_rules = 0; //Apply the direction rules to each track separately instead of across all tracks
+static int parse_threads = 1;   //Threads used to parse the input file
+static int timer_thread = 0;    //One timer thread fires ready events, a worker per track runs crossings
+static double time_scale = 1.0; //Real seconds per simulated second (0.01 runs 100x faster)
+static int handoff = 0;         //Departing train picks and wakes its successor itself
+static const char *metrics_path = NULL; //Write scheduling metrics as JSON here at exit
+static const char *trace_path = NULL;   //Log binary trace records here instead of output.txt
+static int64_t age_limit_ns = 50 * TENTH_NS; //--policy aging: wait after which a low-priority train counts as high
+static int wfq_weight[2] = { 1, 1 };         //--policy wfq: share of the track for East / West
+static const char *batch_dir = NULL;         //--batch: run every input file in this directory
+static int batch_jobs = 0;                   //--jobs: batch workers, 0 = one per core
+static int dispatcher_cpu = -1;              //--dispatcher-cpu: core the dispatcher is pinned to, -1 = any
+static int dispatcher_rt = 0;                //--dispatcher-rt: SCHED_FIFO priority for the dispatcher, 0 = normal
+static size_t train_stack = 0;               //--train-stack: stack bytes for train/crossing threads, 0 = default
+static cpu_set_t train_cpus;                 //--train-cpus: cores train/crossing threads may run on
+static int have_train_cpus = 0;
+
+/*Thread Attributes - built once from the placement options; NULL means the pthread defaults*/
+static pthread_attr_t dispatcher_attr, dispatcher_plain_attr, train_attr;
+static pthread_attr_t *dispatcher_attrp = NULL;
+static pthread_attr_t *dispatcher_plain_attrp = NULL; //Same pinning without the RT priority, used if that is refused
+static pthread_attr_t *train_attrp = NULL;
+
+static int convoy = 0;                       //Same-direction trains may follow each other onto a busy track
+static int64_t convoy_headway_ns = 0;        //--convoy: minimum gap between followers entering (and leaving)
+static int convoy_max = 4;                   //--convoy-max: trains on one track at once
+static int64_t convoy_bound_ns = 20 * TENTH_NS; //--convoy-bound: opposing wait that stops trains from joining
+
+
+/* Parsing & Loading Function Prototypes*/
+static int    load_trains(sim_t *sim, const char *path);
+static int    parse_line(const char *line, const char *eol, int id, train_t *t);
+static void*  parse_chunk(void *arg);
+
+/* Thread Placement Function Prototypes*/
+static int    parse_cpu_list(const char *s, cpu_set_t *set);
+static int    setup_thread_attrs(void);
+static int    start_dispatcher(sim_t *sim, pthread_t *tid);
+
+/* Scenario and Batch Function Prototypes*/
+static int    run_scenario(const char *input, const char *out_path, const char *metrics_out);
+static int    run_batch(const char *dir);
+static void*  batch_worker(void *arg);
+
+/* Train Thread and Dispatcher Function Protoypes*/
+static void*  train_thread(void *arg);
+static void*  dispatcher_main(void *arg);
+static void*  crossing_worker(void *arg);
+static void   cross_track(sim_t *sim, train_t *t);
+static int    leave_track(sim_t *sim, train_t *t);
+static int    run_threaded(sim_t *sim);
+static int    run_timer(sim_t *sim);
+static int    run_virtual(sim_t *sim);
+static void   order_by_loading(const sim_t *sim, int *order);
+
+/* Scheduler Helpers Function Prototypes*/
+static int    any_ready(sim_t *sim);
+static inline int     peek_idx(const ready_queue *q);
+static int    choose_from_pair(ready_queue *A, ready_queue *B);
+static int64_t policy_now(sim_t *sim);
+static sched_state_t* rules_for(sim_t *sim, int track);
+static void   note_crossed(sched_state_t *st, direction_t dir);
+static int    claim_free_track(sim_t *sim);
+static void   schedule_crossing(sim_t *sim, train_t *t, int k);
+static int    convoy_follower(sim_t *sim, int k);
+static void   release_train(sim_t *sim, int idx);
+
+/* Ready-Queue Utilities */
+static int    ready_comes_before(int idxA, int64_t nsA, int idxB, int64_t nsB);
+static int    init_queues(sim_t *sim);
+static ready_queue* class_queue(sim_t *sim, const train_t *t);
+static void   inbox_push(sim_t *sim, train_t *t);
+static int    drain_inboxes(sim_t *sim);
+static void   wake_dispatcher(sim_t *sim);
+static void   queue_push(sim_t *sim, ready_queue *q, int idx, int64_t ready_ns);
+static int    queue_pop(ready_queue *q);
+
+/* Timing and Outputs Function Prototypes */
+static int64_t nano_seconds_difference(const struct timespec *now, const struct timespec *then);
+static int64_t elapsed_ns(sim_t *sim);
+static int64_t sim_now(sim_t *sim);
+static void sleep_until(sim_t *sim, int64_t sim_ns);
+static size_t format_event(stamp_cache *c, const log_rec *r, char *out);
+static int64_t log_now(sim_t *sim, const train_t *t, event_t ev);
+static int64_t log_now_batch(sim_t *sim, const int *idx, int n, event_t ev);
+static void log_event(sim_t *sim, int64_t ns, const train_t *t, event_t ev);
+static int  write_trace_header(sim_t *sim);
+static int  write_metrics(sim_t *sim, const char *path);
+static int  log_start(sim_t *sim);
+static void log_finish(sim_t *sim);
+static const char* dir_text(direction_t d);
+
+static void usage(const char *prog){
+    fprintf(stderr, "Usage: %s [--virtual-time] [--sync-log] [--tracks N] [--track-rules global|per-track] [--parse-threads N] [--timer-thread] [--time-scale F] [--handoff] [--metrics FILE] [--trace FILE] [--policy fcfs|sjf|wfq|aging] [--age-limit N] [--wfq-weights E:W] [--convoy N] [--convoy-max N] [--convoy-bound N]\n"
+                    "       [--dispatcher-cpu N] [--dispatcher-rt PRIO] [--train-stack KB] [--train-cpus LIST] input.txt\n"
+                    "       %s [options] --batch DIR [--jobs N]\n", prog, prog);
+}
+
+int main(int argc, char **argv){
+    static const struct option long_opts[] = {
+        {"virtual-time", no_argument, NULL, 'v'},
+        {"sync-log",     no_argument, NULL, 's'},
+        {"tracks",       required_argument, NULL, 't'},
+        {"track-rules",  required_argument, NULL, 'r'},
+        {"parse-threads", required_argument, NULL, 'p'},
+        {"timer-thread", no_argument, NULL, 'T'},
+        {"time-scale",   required_argument, NULL, 'S'},
+        {"handoff",      no_argument, NULL, 'H'},
+        {"metrics",      required_argument, NULL, 'm'},
+        {"policy",       required_argument, NULL, 'P'},
+        {"age-limit",    required_argument, NULL, 'A'},
+        {"wfq-weights",  required_argument, NULL, 'W'},
+        {"trace",        required_argument, NULL, 'X'},
+        {"dispatcher-cpu", required_argument, NULL, 'D'},
+        {"dispatcher-rt",  required_argument, NULL, 'R'},
+        {"train-stack",  required_argument, NULL, 'K'},
+        {"train-cpus",   required_argument, NULL, 'U'},
+        {"batch",        required_argument, NULL, 'b'},
+        {"jobs",         required_argument, NULL, 'j'},
+        {"convoy",       required_argument, NULL, 'c'},
+        {"convoy-max",   required_argument, NULL, 'C'},
+        {"convoy-bound", required_argument, NULL, 'B'},
+        {NULL, 0, NULL, 0}
+    };
+    int opt;
+    while((opt = getopt_long(argc, argv, "", long_opts, NULL)) != -1){
+        switch(opt){
+            case 'v': virtual_time = 1; break;
+            case 's': sync_log = 1; break;
+            case 't':
+                n_tracks = atoi(optarg);
+                if(n_tracks < 1 || n_tracks > MAX_TRACKS){
+                    fprintf(stderr, "--tracks must be between 1 and %d\n", MAX_TRACKS);
+                    return 1;
+                }
+                break;
+            case 'r':
+                if(strcmp(optarg, "global") == 0){
+                    per_track_rules = 0;
+                }
+                else if(strcmp(optarg, "per-track") == 0){
+                    per_track_rules = 1;
+                }
+                else{
+                    fprintf(stderr, "--track-rules must be global or per-track\n");
+                    return 1;
+                }
+                break;
+            case 'T': timer_thread = 1; break;
+            case 'H': handoff = 1; break;
+            case 'm': metrics_path = optarg; break;
+            case 'P': {
+                size_t i = 0;
+                while(i < sizeof policies / sizeof policies[0] && strcmp(optarg, policies[i].name) != 0){
+                    i++;
+                }
+                if(i == sizeof policies / sizeof policies[0]){
+                    fprintf(stderr, "--policy must be fcfs, sjf, wfq or aging\n");
+                    return 1;
+                }
+#ifdef MTS_POLICY
+                if(&policies[i] != policy){
+                    fprintf(stderr, "This mts was built for --policy %s only\n", policy->name);
+                    return 1;
+                }
+#else
+                policy = &policies[i];
+#endif
+                break;
+            }
+            case 'A':
+                age_limit_ns = atoi(optarg) * TENTH_NS;
+                if(age_limit_ns <= 0){
+                    fprintf(stderr, "--age-limit must be at least 1\n");
+                    return 1;
+                }
+                break;
+            case 'W':
+                if(sscanf(optarg, "%d:%d", &wfq_weight[EAST], &wfq_weight[WEST]) != 2
+                   || wfq_weight[EAST] < 1 || wfq_weight[WEST] < 1){
+                    fprintf(stderr, "--wfq-weights must be E:W with both at least 1\n");
+                    return 1;
+                }
+                break;
+            case 'X': trace_path = optarg; break;
+            case 'D':
+                dispatcher_cpu = atoi(optarg);
+                if(dispatcher_cpu < 0 || dispatcher_cpu >= CPU_SETSIZE){
+                    fprintf(stderr, "--dispatcher-cpu must be between 0 and %d\n", CPU_SETSIZE - 1);
+                    return 1;
+                }
+                break;
+            case 'R': {
+                int lo = sched_get_priority_min(SCHED_FIFO), hi = sched_get_priority_max(SCHED_FIFO);
+                dispatcher_rt = atoi(optarg);
+                if(dispatcher_rt < lo || dispatcher_rt > hi){
+                    fprintf(stderr, "--dispatcher-rt must be between %d and %d\n", lo, hi);
+                    return 1;
+                }
+                break;
+            }
+            case 'K': {
+                long kb = atol(optarg);
+                train_stack = (size_t)(kb > 0 ? kb : 0) * 1024;
+                if(train_stack < (size_t)PTHREAD_STACK_MIN){
+                    fprintf(stderr, "--train-stack must be at least %ld KiB\n", (long)PTHREAD_STACK_MIN / 1024);
+                    return 1;
+                }
+                break;
+            }
+            case 'U':
+                if(parse_cpu_list(optarg, &train_cpus) != 0){
+                    fprintf(stderr, "--train-cpus must be a list like 0-3,6\n");
+                    return 1;
+                }
+                have_train_cpus = 1;
+                break;
+            case 'b': batch_dir = optarg; break;
+            case 'j':
+                batch_jobs = atoi(optarg);
+                if(batch_jobs < 1){
+                    fprintf(stderr, "--jobs must be at least 1\n");
+                    return 1;
+                }
+                break;
+            case 'c':
+                convoy = 1;
+                convoy_headway_ns = atoi(optarg) * TENTH_NS;
+                if(convoy_headway_ns <= 0){
+                    fprintf(stderr, "--convoy headway must be at least 1\n");
+                    return 1;
+                }
+                break;
+            case 'C':
+                convoy_max = atoi(optarg);
+                if(convoy_max < 1 || convoy_max > MAX_CONVOY){
+                    fprintf(stderr, "--convoy-max must be between 1 and %d\n", MAX_CONVOY);
+                    return 1;
+                }
+                break;
+            case 'B':
+                convoy_bound_ns = atoi(optarg) * TENTH_NS;
+                if(convoy_bound_ns < 0){
+                    fprintf(stderr, "--convoy-bound must not be negative\n");
+                    return 1;
+                }
+                break;
+            case 'S':
+                time_scale = strtod(optarg, NULL);
+                if(!(time_scale > 0.0)){
+                    fprintf(stderr, "--time-scale must be greater than 0\n");
+                    return 1;
+                }
+                break;
+            case 'p':
+                parse_threads = atoi(optarg);
+                if(parse_threads < 1 || parse_threads > MAX_PARSE_THREADS){
+                    fprintf(stderr, "--parse-threads must be between 1 and %d\n", MAX_PARSE_THREADS);
+                    return 1;
+                }
+                break;
+            default: usage(argv[0]); return 1;
+        }
+    }
+    if(batch_dir ? optind != argc : optind != argc - 1){
+        usage(argv[0]);
+        return 1;
+    }
+    if(setup_thread_attrs() != 0){
+        return 1;
+    }
+    if(batch_dir){
+        return run_batch(batch_dir);
+    }
+    return run_scenario(argv[optind], trace_path ? trace_path : "output.txt", metrics_path);
+}
+
+/*
+    Parse a CPU list such as "0-3,6" into set. Returns 0 on success, -1 if
+    the list is malformed or names a CPU beyond CPU_SETSIZE.
+*/
+static int parse_cpu_list(const char *s, cpu_set_t *set){
+    CPU_ZERO(set);
+    while(*s){
+        char *end;
+        long lo = strtol(s, &end, 10), hi = lo;
+        if(end == s){
+            return -1;
+        }
+        if(*end == '-'){
+            s = end + 1;
+            hi = strtol(s, &end, 10);
+            if(end == s){
+                return -1;
+            }
+        }
+        if(lo < 0 || hi < lo || hi >= CPU_SETSIZE){
+            return -1;
+        }
+        for(long c = lo; c <= hi; c++){
+            CPU_SET((int)c, set);
+        }
+        if(*end == ','){
+            end++;
+        }
+        else if(*end != '\0'){
+            return -1;
+        }
+        s = end;
+    }
+    return CPU_COUNT(set) > 0 ? 0 : -1;
+}
+
+/*
+    Build the dispatcher and train thread attributes from the placement
+    options. Threads keep the pthread defaults for anything not asked for.
+    Returns 0 on success, -1 if an attribute is rejected.
+*/
+static int setup_thread_attrs(void){
+    int err = 0;
+    if(dispatcher_cpu >= 0 || dispatcher_rt > 0){
+        cpu_set_t one;
+        CPU_ZERO(&one);
+        if(dispatcher_cpu >= 0){
+            CPU_SET(dispatcher_cpu, &one);
+        }
+        pthread_attr_t *attrs[2] = { &dispatcher_plain_attr, &dispatcher_attr };
+        for(int i = 0; i < 2 && err == 0; i++){
+            pthread_attr_init(attrs[i]);
+            if(dispatcher_cpu >= 0){
+                err = pthread_attr_setaffinity_np(attrs[i], sizeof one, &one);
+            }
+        }
+        if(err == 0 && dispatcher_rt > 0){
+            struct sched_param sp = { .sched_priority = dispatcher_rt };
+            err = pthread_attr_setinheritsched(&dispatcher_attr, PTHREAD_EXPLICIT_SCHED);
+            if(err == 0){
+                err = pthread_attr_setschedpolicy(&dispatcher_attr, SCHED_FIFO);
+            }
+            if(err == 0){
+                err = pthread_attr_setschedparam(&dispatcher_attr, &sp);
+            }
+        }
+        dispatcher_attrp = &dispatcher_attr;
+        dispatcher_plain_attrp = &dispatcher_plain_attr;
+    }
+    if(err == 0 && (train_stack > 0 || have_train_cpus)){
+        pthread_attr_init(&train_attr);
+        if(train_stack > 0){
+            err = pthread_attr_setstacksize(&train_attr, train_stack);
+        }
+        if(err == 0 && have_train_cpus){
+            err = pthread_attr_setaffinity_np(&train_attr, sizeof train_cpus, &train_cpus);
+        }
+        train_attrp = &train_attr;
+    }
+    if(err != 0){
+        fprintf(stderr, "Thread placement options rejected: %s\n", strerror(err));
+        return -1;
+    }
+    return 0;
+}
+
+/*
+    Start the dispatcher with the placement options. If the kernel refuses
+    the real-time priority (no CAP_SYS_NICE), warn once and start it with
+    the same pinning at normal priority. Returns 0 or the pthread error.
+*/
+static int start_dispatcher(sim_t *sim, pthread_t *tid){
+    static atomic_int warned;
+    int err = pthread_create(tid, dispatcher_attrp, dispatcher_main, sim);
+    if(err == EPERM && dispatcher_rt > 0){
+        if(!atomic_exchange(&warned, 1)){
+            fprintf(stderr, "--dispatcher-rt not permitted, running the dispatcher at normal priority\n");
+        }
+        err = pthread_create(tid, dispatcher_plain_attrp, dispatcher_main, sim);
+    }
+    if(err != 0){
+        errno = err;
+        perror("pthread_create(dispatcher)");
+    }
+    return err;
+}
+
+/*
+    Run one scenario in a fresh context: parse input, simulate it, log to
+    out_path and, if metrics_out is set, write the metrics there.
+    Returns 0 on success, 1 on error.
+*/
+static int run_scenario(const char *input, const char *out_path, const char *metrics_out){
+    sim_t *sim = (sim_t*)calloc(1, sizeof *sim);
+    if(!sim){
+        fprintf(stderr, "Malloc failed in run_scenario\n");
+        return 1;
+    }
+    sim->input = input;
+    sim->out_path = out_path;
+    pthread_mutex_init(&sim->output_mutex, NULL);
+    pthread_mutex_init(&sim->scheduling_mutex, NULL);
+    pthread_cond_init(&sim->ready_cv, NULL);
+    pthread_cond_init(&sim->work_cv, NULL);
+    sim->global_rules.last_dir = EAST; //Arbitrary Value
+    for(int k = 0; k < n_tracks; k++){
+        sim->tracks[k].occupants = 0;
+        sim->tracks[k].free_at_ns = 0;
+        sim->tracks[k].rules = sim->global_rules;
+    }
+    sim->free_tracks = n_tracks;
+
+    int rc = 1;
+    sim->outf = fopen(out_path, "w");
+    if(!sim->outf){
+        perror(out_path);
+    }
+    else if(load_trains(sim, input) != 0){
+        fprintf(stderr, "Failed to parse input file: %s\n", input);
+    }
+    else if(trace_path && write_trace_header(sim) != 0){
+        perror(out_path);
+    }
+    else if(init_queues(sim) == 0 && (sync_log || log_start(sim) == 0)){
+        rc = virtual_time ? run_virtual(sim) : (timer_thread ? run_timer(sim) : run_threaded(sim));
+        if(rc == 0 && metrics_out && write_metrics(sim, metrics_out) != 0){
+            rc = 1;
+        }
+        log_finish(sim); //flushes every queued line before the file is closed
+    }
+
+    if(sim->outf){
+        fclose(sim->outf);
+    }
+    free(sim->ready_pool);
+    free(sim->trains);
+    pthread_mutex_destroy(&sim->output_mutex);
+    pthread_mutex_destroy(&sim->scheduling_mutex);
+    pthread_cond_destroy(&sim->ready_cv);
+    pthread_cond_destroy(&sim->work_cv);
+    free(sim);
+    return rc;
+}
+
+/* 1 if name ends with suffix */
+static int has_suffix(const char *name, const char *suffix){
+    size_t n = strlen(name), m = strlen(suffix);
+    return n >= m && strcmp(name + n - m, suffix) == 0;
+}
+
+static int cmp_path(const void *a, const void *b){
+    return strcmp(*(char *const*)a, *(char *const*)b);
+}
+
+/*
+    Batch worker: claim the next scenario until none are left. Each one
+    writes <input>.out (<input><trace suffix> under --trace), plus
+    <input><metrics suffix> under --metrics.
+*/
+static void* batch_worker(void *arg){
+    batch_t *b = (batch_t*)arg;
+    for(;;){
+        int i = atomic_fetch_add(&b->next, 1);
+        if(i >= b->n){
+            break;
+        }
+        char out_path[PATH_MAX], metrics_out[PATH_MAX];
+        snprintf(out_path, sizeof out_path, "%s%s", b->inputs[i], trace_path ? trace_path : ".out");
+        snprintf(metrics_out, sizeof metrics_out, "%s%s", b->inputs[i], metrics_path ? metrics_path : "");
+        if(run_scenario(b->inputs[i], out_path, metrics_path ? metrics_out : NULL) != 0){
+            fprintf(stderr, "Scenario failed: %s\n", b->inputs[i]);
+            atomic_fetch_add(&b->failed, 1);
+        }
+    }
+    return NULL;
+}
+
+/*
+    --batch: run every regular file in dir (skipping dotfiles, .out and
+    .json files, i.e. earlier outputs) as its own scenario, on --jobs workers (default: one per
+    online core). Returns 0 if every scenario succeeded, 1 otherwise.
+*/
+static int run_batch(const char *dir){
+    DIR *d = opendir(dir);
+    if(!d){
+        perror(dir);
+        return 1;
+    }
+    batch_t b;
+    b.inputs = NULL;
+    b.n = 0;
+    int cap = 0;
+    struct dirent *de;
+    while((de = readdir(d)) != NULL){
+        if(de->d_name[0] == '.' || has_suffix(de->d_name, ".out") || has_suffix(de->d_name, ".json")
+           || (metrics_path && has_suffix(de->d_name, metrics_path))
+           || (trace_path && has_suffix(de->d_name, trace_path))){
+            continue;
+        }
+        char path[PATH_MAX];
+        struct stat st;
+        snprintf(path, sizeof path, "%s/%s", dir, de->d_name);
+        if(stat(path, &st) != 0 || !S_ISREG(st.st_mode)){
+            continue;
+        }
+        if(b.n == cap){
+            cap = cap ? cap * 2 : 64;
+            char **tmp = (char**)realloc(b.inputs, sizeof(char*) * (size_t)cap);
+            if(!tmp){
+                break;
+            }
+            b.inputs = tmp;
+        }
+        if(!(b.inputs[b.n] = strdup(path))){
+            break;
+        }
+        b.n++;
+    }
+    int listed = (de == NULL);
+    closedir(d);
+    if(!listed){
+        fprintf(stderr, "Malloc failed in run_batch\n");
+    }
+    qsort(b.inputs, (size_t)b.n, sizeof(char*), cmp_path); //claim scenarios in a stable order
+
+    int jobs = batch_jobs > 0 ? batch_jobs : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if(jobs > b.n){
+        jobs = b.n;
+    }
+    if(jobs < 1){
+        jobs = 1;
+    }
+    atomic_init(&b.next, 0);
+    atomic_init(&b.failed, 0);
+    pthread_t *tids = (pthread_t*)malloc(sizeof(pthread_t) * (size_t)jobs);
+    int started = 0;
+    while(tids && started < jobs && pthread_create(&tids[started], NULL, batch_worker, &b) == 0){
+        started++;
+    }
+    if(started == 0){
+        batch_worker(&b); //no pool: run them all here
+    }
+    for(int w = 0; w < started; w++){
+        pthread_join(tids[w], NULL);
+    }
+    free(tids);
+
+    int failed = atomic_load(&b.failed);
+    if(failed > 0){
+        fprintf(stderr, "%d of %d scenarios failed\n", failed, b.n);
+    }
+    for(int i = 0; i < b.n; i++){
+        free(b.inputs[i]);
+    }
+    free(b.inputs);
+    return (failed > 0 || !listed) ? 1 : 0;
+}
+
+/*
+    Real-time simulation: one dispatcher thread plus one thread per train.
+    Returns 0 once every train has crossed, 1 if a thread could not be started.
+*/
+
+static int run_threaded(sim_t *sim){
+    clock_gettime(CLOCK_MONOTONIC, &sim->start);
+
+    pthread_t dispatcher_tid;
+    if(start_dispatcher(sim, &dispatcher_tid) != 0){
+        return 1;
+    }
+
+    for(int i = 0; i < sim->n_trains; i++){
+        if(pthread_create(&sim->trains[i].tid, train_attrp, train_thread, &sim->trains[i]) != 0){
+            perror("pthread_create(train)");
+            //cleanup already-started trains
+            for (int j = 0; j < i; j++) {
+                pthread_join(sim->trains[j].tid, NULL);
+                sem_destroy(&sim->trains[j].go);
+            }
+            pthread_cancel(dispatcher_tid);
+            pthread_join(dispatcher_tid, NULL);
+            return 1;
+        }
+    }
+
+    for (int i = 0; i < sim->n_trains; i++){
+        pthread_join(sim->trains[i].tid, NULL);
+        sem_destroy(&sim->trains[i].go);
+    }
+
+    pthread_join(dispatcher_tid, NULL);
+    return 0;
+}
+
+/*
+    Real-time simulation without a thread per train (--timer-thread).
+    The calling thread acts as the timer: it sleeps until each distinct
+    loading deadline (sleep_until, i.e. clock_nanosleep(TIMER_ABSTIME)) and enqueues every
+    train due at that instant under one lock. The dispatcher is unchanged
+    except that it hands chosen trains to a pool of one crossing worker per
+    track (per convoy slot under --convoy), so thread count and stack memory
+    no longer grow with n_trains.
+*/
+
+static int run_timer(sim_t *sim){
+    int *order = (int*)malloc(sizeof(int) * (size_t)(sim->n_trains > 0 ? sim->n_trains : 1));
+    sim->work_queue = (int*)malloc(sizeof(int) * (size_t)(sim->n_trains > 0 ? sim->n_trains : 1));
+    if(!order || !sim->work_queue){
+        fprintf(stderr, "Malloc failed in run_timer\n");
+        free(order);
+        free(sim->work_queue);
+        sim->work_queue = NULL;
+        return 1;
+    }
+    order_by_loading(sim, order);
+
+    clock_gettime(CLOCK_MONOTONIC, &sim->start);
+
+    pthread_t dispatcher_tid;
+    pthread_t workers[MAX_TRACKS * MAX_CONVOY];
+    int n_workers = 0;
+    int want_workers = n_tracks * (convoy ? convoy_max : 1);
+    int rc = 0;
+    if(start_dispatcher(sim, &dispatcher_tid) != 0){
+        free(order);
+        free(sim->work_queue);
+        sim->work_queue = NULL;
+        return 1;
+    }
+    for(; n_workers < want_workers; n_workers++){
+        if(pthread_create(&workers[n_workers], train_attrp, crossing_worker, sim) != 0){
+            perror("pthread_create(worker)");
+            rc = 1;
+            break;
+        }
+    }
+
+    //Fire ready events in deadline order, one batch per distinct loading time
+    for(int i = 0; rc == 0 && i < sim->n_trains; ){
+        int loading = sim->trains[order[i]].loading_time;
+        sleep_until(sim, loading * TENTH_NS);
+
+        int first = i;
+        while(i < sim->n_trains && sim->trains[order[i]].loading_time == loading){
+            i++;
+        }
+        int64_t now = log_now_batch(sim, &order[first], i - first, EV_READY);
+        for(int j = first; j < i; j++){
+            sim->trains[order[j]].ready_time_ns = now; //same stamp, so the ID tie-break decides
+        }
+        for(int j = first; j < i; j++){
+            inbox_push(sim, &sim->trains[order[j]]);
+        }
+        wake_dispatcher(sim);
+    }
+
+    if(rc != 0){
+        //Stop the dispatcher and any workers already running
+        pthread_mutex_lock(&sim->scheduling_mutex);
+        sim->trains_finished = sim->n_trains;
+        pthread_cond_broadcast(&sim->ready_cv);
+        pthread_cond_broadcast(&sim->work_cv);
+        pthread_mutex_unlock(&sim->scheduling_mutex);
+    }
+    for(int w = 0; w < n_workers; w++){
+        pthread_join(workers[w], NULL);
+    }
+    pthread_join(dispatcher_tid, NULL);
+    for(int i = 0; i < sim->n_trains; i++){
+        sem_destroy(&sim->trains[i].go);
+    }
+    free(order);
+    free(sim->work_queue);
+    sim->work_queue = NULL;
+    return rc;
+}
+
+/*
+    Crossing worker (--timer-thread).
+    Takes dispatched trains off the work queue and runs their crossing,
+    exiting once every train has finished. Under --handoff the worker runs
+    the successor picked by leave_track straight away on the same track.
+*/
+
+static void* crossing_worker(void *arg){
+    sim_t *sim = (sim_t*)arg;
+    pthread_mutex_lock(&sim->scheduling_mutex);
+    for(;;){
+        while(sim->work_head == sim->work_tail && sim->trains_finished < sim->n_trains){
+            pthread_cond_wait(&sim->work_cv, &sim->scheduling_mutex);
+        }
+        if(sim->work_head == sim->work_tail){
+            break;
+        }
+        int idx = sim->work_queue[sim->work_head++];
+        while(idx >= 0){
+            pthread_mutex_unlock(&sim->scheduling_mutex);
+
+            cross_track(sim, &sim->trains[idx]);
+
+            pthread_mutex_lock(&sim->scheduling_mutex);
+            idx = leave_track(sim, &sim->trains[idx]);
+        }
+    }
+    pthread_mutex_unlock(&sim->scheduling_mutex);
+    return NULL;
+}
+
+/*
+    Map the whole input file (or read it, when it cannot be mapped) so the
+    parser can walk it in place. Fills in data, size and mapped; returns 0 on
+    success, -1 on error.
+*/
+
+static int map_input(const char *path, char **data, size_t *size, int *mapped) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror("open");
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        *mapped = 1;
+        *size = (size_t)st.st_size;
+        *data = NULL;
+        if (*size > 0) {
+            void *p = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p == MAP_FAILED) {
+                perror("mmap");
+                close(fd);
+                return -1;
+            }
+            madvise(p, *size, MADV_SEQUENTIAL);
+            *data = (char*)p;
+        }
+        close(fd);
+        return 0;
+    }
+
+    //Pipes and other unmappable inputs: slurp into a growing buffer
+    size_t cap = 1 << 16, len = 0;
+    char *buf = (char*)malloc(cap);
+    for (;;) {
+        if (!buf) {
+            fprintf(stderr, "Malloc failed in map_input\n");
+            close(fd);
+            return -1;
+        }
+        ssize_t r = read(fd, buf + len, cap - len);
+        if (r < 0 && errno == EINTR) {
+            continue;
+        }
+        if (r < 0) {
+            perror("read");
+            free(buf);
+            close(fd);
+            return -1;
+        }
+        if (r == 0) {
+            break;
+        }
+        len += (size_t)r;
+        if (len == cap) {
+            cap *= 2;
+            char *tmp = (char*)realloc(buf, cap);
+            if (!tmp) {
+                free(buf);
+            }
+            buf = tmp;
+        }
+    }
+    close(fd);
+    *data = buf;
+    *size = len;
+    *mapped = 0;
+    return 0;
+}
+
+/* Print "Parse error on line N: <line>" for the line starting at text. */
+static void report_parse_error(int line_no, const char *text, const char *end) {
+    const char *eol = memchr(text, '\n', (size_t)(end - text));
+    size_t len = eol ? (size_t)(eol - text) + 1 : (size_t)(end - text);
+    fprintf(stderr, "Parse error on line %d: %.*s", line_no, (int)len, text);
+}
+
+/*
+    Read the input file and build the trains[] array in a single pass over a
+    memory-mapped copy of the file. With --parse-threads N the file is split
+    into N chunks on line boundaries that are parsed concurrently and then
+    stitched back together in file order.
+    Blank lines are only accepted at the end of the file, as before; any
+    other bad line is reported with its line number.
+    On success sets n_trains and returns 0; on error returns -1
+*/
+
+static int load_trains(sim_t *sim, const char *path) {
+    char *data;
+    size_t size;
+    int mapped;
+    if (map_input(path, &data, &size, &mapped) != 0) {
+        return -1;
+    }
+    const char *end = data + size;
+
+    //Split into chunks of whole lines
+    int nchunks = parse_threads;
+    if ((size_t)nchunks > size / MIN_PARSE_CHUNK) {
+        nchunks = (int)(size / MIN_PARSE_CHUNK);
+    }
+    if (nchunks < 1) {
+        nchunks = 1;
+    }
+    parse_chunk_t chunks[MAX_PARSE_THREADS];
+    const char *p = data;
+    for (int c = 0; c < nchunks; c++) {
+        const char *stop = end;
+        if (c + 1 < nchunks) {
+            stop = data + size / (size_t)nchunks * (size_t)(c + 1);
+            if (stop < p) {
+                stop = p;
+            }
+            const char *nl = memchr(stop, '\n', (size_t)(end - stop));
+            stop = nl ? nl + 1 : end;
+        }
+        memset(&chunks[c], 0, sizeof chunks[c]);
+        chunks[c].begin = p;
+        chunks[c].end = stop;
+        p = stop;
+    }
+
+    pthread_t tids[MAX_PARSE_THREADS];
+    int started[MAX_PARSE_THREADS] = {0};
+    for (int c = 1; c < nchunks; c++) {
+        started[c] = (pthread_create(&tids[c], NULL, parse_chunk, &chunks[c]) == 0);
+    }
+    parse_chunk(&chunks[0]);
+    for (int c = 1; c < nchunks; c++) {
+        if (started[c]) {
+            pthread_join(tids[c], NULL);
+        }
+        else {
+            parse_chunk(&chunks[c]);
+        }
+    }
+
+    //Stitch chunks together in file order, reporting the first error
+    int ok = 1;
+    int total = 0, line_base = 0;
+    int pending_line = 0;            //blank line that is only fine if nothing follows
+    const char *pending_text = NULL;
+    for (int c = 0; c < nchunks && ok; c++) {
+        parse_chunk_t *ch = &chunks[c];
+        if (ch->nomem) {
+            fprintf(stderr, "Realloc failed in load_trains\n");
+            ok = 0;
+            break;
+        }
+        if (pending_line && (ch->n > 0 || ch->err_line)) {
+            report_parse_error(pending_line, pending_text, end);
+            ok = 0;
+            break;
+        }
+        if (ch->err_line) {
+            report_parse_error(line_base + ch->err_line, ch->err_text, end);
+            ok = 0;
+            break;
+        }
+        if (ch->blank_line && !pending_line) {
+            pending_line = line_base + ch->blank_line;
+            pending_text = ch->blank_text;
+        }
+        total += ch->n;
+        line_base += ch->lines;
+    }
+
+    if (ok && total > 0) {
+        if (nchunks == 1) {
+            sim->trains = chunks[0].trains;
+            chunks[0].trains = NULL;
+        }
+        else {
+            sim->trains = (train_t*)malloc(sizeof(train_t) * (size_t)total);
+            if (!sim->trains) {
+                fprintf(stderr, "Malloc failed in load_trains\n");
+                ok = 0;
+            }
+            else {
+                int at = 0;
+                for (int c = 0; c < nchunks; c++) {
+                    memcpy(&sim->trains[at], chunks[c].trains, sizeof(train_t) * (size_t)chunks[c].n);
+                    at += chunks[c].n;
+                }
+            }
+        }
+    }
+    for (int c = 0; c < nchunks; c++) {
+        free(chunks[c].trains);
+    }
+    if (mapped) {
+        if (data) {
+            munmap(data, size);
+        }
+    }
+    else {
+        free(data);
+    }
+
+    if (!ok) {
+        free(sim->trains);
+        sim->trains = NULL;
+        sim->n_trains = 0;
+        return -1;
+    }
+
+    //IDs follow file order across chunks; per-train sync objects are set up once here
+    for (int id = 0; id < total; id++) {
+        sim->trains[id].id = id;
+        sim->trains[id].sim = sim;
+        sem_init(&sim->trains[id].go, 0, 0);
+    }
+    sim->n_trains = total;
+    return 0;
+}
+
+/*
+    Parser worker: turn the lines of one chunk into train records and note
+    the first bad line. Also used directly for the single-threaded case.
+*/
+
+static void* parse_chunk(void *arg) {
+    parse_chunk_t *ch = (parse_chunk_t*)arg;
+    const char *p = ch->begin;
+    while (p < ch->end) {
+        const char *eol = memchr(p, '\n', (size_t)(ch->end - p));
+        const char *next = eol ? eol + 1 : ch->end;
+        if (!eol) {
+            eol = ch->end;
+        }
+        ch->lines++;
+
+        const char *q = p;
+        while (q < eol && (*q == ' ' || *q == '\t')) {
+            q++;
+        }
+        if (q == eol) {
+            //Blank: fine at the end of the file, an error before another train
+            if (!ch->blank_line) {
+                ch->blank_line = ch->lines;
+                ch->blank_text = p;
+            }
+            p = next;
+            continue;
+        }
+        if (ch->blank_line) {
+            ch->err_line = ch->blank_line;
+            ch->err_text = ch->blank_text;
+            return NULL;
+        }
+
+        if (ch->n == ch->cap) {
+            int cap = ch->cap ? ch->cap * 2 : 64;
+            train_t *tmp = (train_t*)realloc(ch->trains, sizeof(train_t) * (size_t)cap);
+            if (!tmp) {
+                ch->nomem = 1;
+                return NULL;
+            }
+            ch->trains = tmp;
+            ch->cap = cap;
+        }
+        if (parse_line(p, eol, ch->n, &ch->trains[ch->n]) != 0) {
+            ch->err_line = ch->lines;
+            ch->err_text = p;
+            return NULL;
+        }
+        ch->n++;
+        p = next;
+    }
+    return NULL;
+}
+
+/* Whitespace as scanf's " " directive sees it */
+static inline int is_space(char c){
+    return c == ' ' || c == '\t' || c == '\r' || c == '\v' || c == '\f' || c == '\n';
+}
+
+/*
+    Scan an optionally signed decimal integer the way scanf's %d does
+    (leading whitespace skipped). Values too large for a time are clamped,
+    which the range check then rejects. Returns NULL if there is no number.
+*/
+static const char* scan_int(const char *p, const char *eol, int *out){
+    while (p < eol && is_space(*p)) {
+        p++;
+    }
+    int neg = 0;
+    if (p < eol && (*p == '-' || *p == '+')) {
+        neg = (*p == '-');
+        p++;
+    }
+    if (p == eol || *p < '0' || *p > '9') {
+        return NULL;
+    }
+    int v = 0;
+    while (p < eol && *p >= '0' && *p <= '9') {
+        if (v < 100000) {
+            v = v * 10 + (*p - '0');
+        }
+        p++;
+    }
+    *out = neg ? -v : v;
+    return p;
+}
+
+/*
+    Parse one train description line (e.g. "E 3 4", ending at eol) into a train_t record.
+    Accepts what sscanf(" %c %d %d") would, using a hand-written scanner.
+    Validates direction and that loading/crossing times are in 1..99, then initializes
+    the per-train fields (id, dir, priority, times).
+*/
+
+static int parse_line(const char *line, const char *eol, int id, train_t *t) {
+    const char *p = line;
+    while (p < eol && is_space(*p)) {
+        p++;
+    }
+    if (p == eol) {
+        return -1;
+    }
+    char c = *p++;
+    int load, cross;
+    if (!(p = scan_int(p, eol, &load)) || !scan_int(p, eol, &cross)){
+        return -1;
+    }
+    if (load < 1 || load > 99 || cross < 1 || cross > 99){
+        return -1;
+    }
+
+    int high = 0;
+    switch (c) {
+        case 'e': high = 0; t->dir = EAST; break;
+        case 'E': high = 1; t->dir = EAST; break;
+        case 'w': high = 0; t->dir = WEST; break;
+        case 'W': high = 1; t->dir = WEST; break;
+        default: return -1;
+    }
+
+    t->id = id;
+    t->high_priority = high;
+    t->loading_time = load;
+    t->crossing_time = cross;
+    t->ready_time_ns = -1;
+    t->inbox_next = -1;
+    t->track = -1;
+    return 0;
+}
+
+/* 
+    Thread routine for a single train.
+    Simulates loading, announces “ready”, enqueues itself in the correct
+    priority/direction queue, then waits until the dispatcher chooses it.
+    When dispatched, it logs ON/OFF around the crossing, updates global
+    scheduling state, and wakes the dispatcher to pick the next train.
+ */ 
+
+static void* train_thread(void *arg){
+    //Cast void* -> train_t* to use its fields
+    train_t *t = (train_t*)arg;
+    sim_t *sim = t->sim;
+
+    //Simulate Loading
+    sleep_until(sim, t->loading_time * TENTH_NS);
+
+    //Stamp Ready time and log the Train Ready Line
+    t->ready_time_ns = log_now(sim, t, EV_READY);
+
+    //Enqueue without taking scheduling_mutex, notify dispatcher and wait
+    inbox_push(sim, t);
+    wake_dispatcher(sim);
+    while (sem_wait(&t->go) != 0 && errno == EINTR) {
+        continue;
+    }
+    //Enter track
+
+    cross_track(sim, t);
+
+    pthread_mutex_lock(&sim->scheduling_mutex);
+    int next = leave_track(sim, t);
+    pthread_mutex_unlock(&sim->scheduling_mutex);
+    if (next >= 0) {
+        sem_post(&sim->trains[next].go); //--handoff: successor goes straight on
+    }
+    return NULL;
+}
+
+/*
+    ON -> Cross -> Off, for a train the dispatcher has put on t->track.
+    A convoy follower first waits out its headway behind the train ahead.
+*/
+static void cross_track(sim_t *sim, train_t *t){
+    if(convoy){
+        sleep_until(sim, t->on_deadline_ns);
+    }
+    t->on_ns = log_now(sim, t, EV_ON);
+
+    sleep_until(sim, t->off_deadline_ns);
+
+    t->off_ns = log_now(sim, t, EV_OFF);
+}
+
+/*
+    Account for a train leaving its track. Called with scheduling_mutex held.
+    Under --handoff the departing train runs the scheduling decision itself:
+    if anyone is ready it keeps the track in use, schedules the successor on
+    it and returns the successor's index for the caller to wake, leaving the
+    dispatcher out of the critical path. Otherwise the track is freed and the
+    dispatcher gets a single wake-up; returns -1. A track with convoy
+    followers still on it stays busy, and the dispatcher is told a convoy
+    slot opened up.
+*/
+static int leave_track(sim_t *sim, train_t *t){
+    int k = t->track;
+
+    // update streak + counters WHILE holding the lock
+    note_crossed(rules_for(sim, k), t->dir);
+    sim->trains_finished++;
+
+    if (sim->tracks[k].occupants > 1) {
+        sim->tracks[k].occupants--;
+        pthread_cond_signal(&sim->ready_cv);
+        return -1;
+    }
+
+    if (handoff) {
+        drain_inboxes(sim);
+        if (any_ready(sim)) {
+            int idx = CHOOSE_NEXT(sim, rules_for(sim, k));
+            schedule_crossing(sim, &sim->trains[idx], k);
+            if (convoy) {
+                pthread_cond_signal(&sim->ready_cv); //others may follow the successor
+            }
+            return idx;
+        }
+    }
+
+    sim->tracks[k].occupants = 0;
+    sim->free_tracks++;
+    pthread_cond_signal(&sim->ready_cv); //only the dispatcher waits on ready_cv
+    if (sim->trains_finished >= sim->n_trains) {
+        pthread_cond_broadcast(&sim->work_cv); //idle crossing workers can exit
+    }
+    return -1;
+}
+
+/* 
+    Dispatcher thread.
+    Waits until at least one train is ready and a track is free, then
+    selects the next train according to the scheduling rules (priority,
+    direction balancing, tie-breaking), marks the track as in use, and
+    posts exactly that train’s semaphore (or queues it for a crossing
+    worker under --timer-thread). Repeats while both
+    free tracks and ready trains remain. Runs until all trains have finished.
+    Newly ready trains are collected from the class inboxes in one batch
+    before each scheduling decision. Under --convoy it also lets ready
+    trains follow the trains already on a busy track, so it listens for
+    new arrivals even when every track is taken.
+ */
+
+
+static void* dispatcher_main(void *arg) {
+    sim_t *sim = (sim_t*)arg;
+    pthread_mutex_lock(&sim->scheduling_mutex);
+    while (sim->trains_finished < sim->n_trains) {
+        drain_inboxes(sim);
+        if ((sim->free_tracks > 0 || convoy) && !any_ready(sim)) {
+            //About to wait for trains: ask the next one to signal us, then re-check
+            atomic_store(&sim->dispatcher_idle, 1);
+            drain_inboxes(sim);
+            if (any_ready(sim)) {
+                atomic_store(&sim->dispatcher_idle, 0);
+            }
+        }
+        if (sim->trains_finished >= sim->n_trains){
+            break;
+        }
+        if (!any_ready(sim) || (sim->free_tracks == 0 && !convoy)) {
+            pthread_cond_wait(&sim->ready_cv, &sim->scheduling_mutex);
+            continue;
+        }
+
+        while (sim->free_tracks > 0 && any_ready(sim)) {
+            int k = claim_free_track(sim);
+            int idx = CHOOSE_NEXT(sim, rules_for(sim, k));
+            schedule_crossing(sim, &sim->trains[idx], k);
+            release_train(sim, idx);
+        }
+        if (convoy) {
+            for (int k = 0; k < n_tracks; k++) {
+                int idx;
+                while ((idx = convoy_follower(sim, k)) >= 0) {
+                    release_train(sim, idx);
+                }
+            }
+            if (any_ready(sim)) {
+                //Whoever is left cannot go yet: sleep until a train arrives or leaves
+                atomic_store(&sim->dispatcher_idle, 1);
+                if (drain_inboxes(sim) == 0) {
+                    pthread_cond_wait(&sim->ready_cv, &sim->scheduling_mutex);
+                }
+                atomic_store(&sim->dispatcher_idle, 0);
+            }
+        }
+    }
+    pthread_mutex_unlock(&sim->scheduling_mutex);
+    return NULL;
+}
+
+/* Start a dispatched train: post its semaphore, or queue it for a crossing worker (--timer-thread). */
+static void release_train(sim_t *sim, int idx){
+    if (sim->work_queue) {
+        sim->work_queue[sim->work_tail++] = idx;
+        pthread_cond_signal(&sim->work_cv);
+    }
+    else {
+        sem_post(&sim->trains[idx].go);
+    }
+}
+
+/*
+    Fill order[] with train indices sorted by the time they finish loading,
+    then by ID (the tie-break rule). Loading times are 1..99, so a counting
+    sort does it in one pass and keeps IDs in order within each time.
+*/
+static void order_by_loading(const sim_t *sim, int *order){
+    int at[100 + 1] = {0};
+    for(int i = 0; i < sim->n_trains; i++){
+        at[sim->trains[i].loading_time + 1]++;
+    }
+    for(int l = 1; l <= 100; l++){
+        at[l] += at[l - 1];
+    }
+    for(int i = 0; i < sim->n_trains; i++){
+        order[at[sim->trains[i].loading_time]++] = i;
+    }
+}
+
+/*
+    Virtual-time simulation (--virtual-time).
+    Replays the same scheduling rules as the threaded run on a single thread,
+    jumping a simulated clock from one event to the next instead of sleeping.
+    Events sharing a timestamp are applied as: trains becoming ready (by ID),
+    then trains leaving a track (by track), then convoy followers entering,
+    then the dispatch decisions. This is the reference schedule: each
+    decision sees every train ready at that tick, where the threaded
+    dispatcher only sees those that have queued so far, so the two only
+    agree when no two trains become ready on the same tick.
+*/
+
+static int run_virtual(sim_t *sim){
+    int *order = (int*)malloc(sizeof(int) * (size_t)(sim->n_trains > 0 ? sim->n_trains : 1));
+    if(!order){
+        fprintf(stderr, "Malloc failed in run_virtual\n");
+        return 1;
+    }
+    order_by_loading(sim, order);
+
+    int next_ready = 0;                    //next entry of order[] still loading
+    int on_track[MAX_TRACKS][MAX_CONVOY];  //trains on each track, in the order they leave
+    int n_on[MAX_TRACKS];                  //how many trains are on each track
+    int n_entered[MAX_TRACKS];             //how many of those have logged ON
+    for(int k = 0; k < n_tracks; k++){
+        n_on[k] = 0;
+        n_entered[k] = 0;
+    }
+    while(sim->trains_finished < sim->n_trains){
+        //Advance the clock to the earliest pending event
+        int64_t now = INT64_MAX;
+        if(next_ready < sim->n_trains){
+            now = sim->trains[order[next_ready]].loading_time * TENTH_NS;
+        }
+        for(int k = 0; k < n_tracks; k++){
+            if(n_on[k] > 0 && sim->trains[on_track[k][0]].off_deadline_ns < now){
+                now = sim->trains[on_track[k][0]].off_deadline_ns;
+            }
+            if(n_entered[k] < n_on[k] && sim->trains[on_track[k][n_entered[k]]].on_deadline_ns < now){
+                now = sim->trains[on_track[k][n_entered[k]]].on_deadline_ns;
+            }
+        }
+        sim->virtual_now_ns = now;
+
+        //Trains finishing loading now
+        while(next_ready < sim->n_trains && sim->trains[order[next_ready]].loading_time * TENTH_NS == now){
+            train_t *t = &sim->trains[order[next_ready++]];
+            t->ready_time_ns = now;
+            log_event(sim, now, t, EV_READY);
+            queue_push(sim, class_queue(sim, t), t->id, t->ready_time_ns);
+        }
+
+        //Trains leaving a track now (convoys leave in the order they entered)
+        for(int k = 0; k < n_tracks; k++){
+            while(n_on[k] > 0 && sim->trains[on_track[k][0]].off_deadline_ns == now){
+                train_t *t = &sim->trains[on_track[k][0]];
+                t->off_ns = now;
+                log_event(sim, now, t, EV_OFF);
+                if(--sim->tracks[k].occupants == 0){
+                    sim->free_tracks++;
+                }
+                note_crossed(rules_for(sim, k), t->dir);
+                sim->trains_finished++;
+                memmove(&on_track[k][0], &on_track[k][1], sizeof(int) * (size_t)--n_on[k]);
+                n_entered[k]--;
+            }
+        }
+
+        //Convoy followers whose headway is up
+        for(int k = 0; k < n_tracks; k++){
+            while(n_entered[k] < n_on[k] && sim->trains[on_track[k][n_entered[k]]].on_deadline_ns == now){
+                train_t *t = &sim->trains[on_track[k][n_entered[k]++]];
+                t->on_ns = now;
+                log_event(sim, now, t, EV_ON);
+            }
+        }
+
+        //Dispatch onto free tracks
+        while(sim->free_tracks > 0 && any_ready(sim)){
+            int k = claim_free_track(sim);
+            int idx = CHOOSE_NEXT(sim, rules_for(sim, k));
+            train_t *t = &sim->trains[idx];
+            schedule_crossing(sim, t, k);
+            on_track[k][n_on[k]++] = idx;
+            n_entered[k]++;
+            t->on_ns = now;
+            log_event(sim, now, t, EV_ON);
+        }
+
+        //Let ready trains join the convoys already on the tracks
+        for(int k = 0; convoy && k < n_tracks; k++){
+            int idx;
+            while((idx = convoy_follower(sim, k)) >= 0){
+                on_track[k][n_on[k]++] = idx;
+                if(sim->trains[idx].on_deadline_ns == now){
+                    sim->trains[idx].on_ns = now;
+                    log_event(sim, now, &sim->trains[idx], EV_ON);
+                    n_entered[k]++;
+                }
+            }
+        }
+    }
+    free(order);
+    return 0;
+}
+
+/* Nanoseconds since the simulation started */
+static int64_t elapsed_ns(sim_t *sim){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return nano_seconds_difference(&now, &sim->start);
+}
+
+/* Simulated nanoseconds since start: real elapsed time undone by --time-scale */
+static int64_t sim_now(sim_t *sim){
+    int64_t ns = elapsed_ns(sim);
+    return (time_scale == 1.0) ? ns : (int64_t)((double)ns / time_scale);
+}
+
+/*
+    Sleep until an absolute simulated time measured from start. Deadlines are
+    absolute so the wake-up latency of one wait never carries into the next.
+*/
+static void sleep_until(sim_t *sim, int64_t sim_ns){
+    int64_t real_ns = (time_scale == 1.0) ? sim_ns : (int64_t)((double)sim_ns * time_scale);
+    int64_t nsec = (int64_t)sim->start.tv_nsec + real_ns % 1000000000LL;
+    struct timespec due;
+    due.tv_sec = sim->start.tv_sec + (time_t)(real_ns / 1000000000LL + nsec / 1000000000LL);
+    due.tv_nsec = (long)(nsec % 1000000000LL);
+    while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, NULL) == EINTR){
+        continue;
+    }
+}
+
+/*
+    Format one record as an output.txt line into out (at least LOG_LINE_MAX
+    bytes) and return its length. The "HH:MM:SS." prefix comes from c and is
+    only rebuilt when the record falls in a different second than the last
+    one, so a line normally costs one division for the tenths digit.
+*/
+static size_t format_event(stamp_cache *c, const log_rec *r, char *out){
+    static const char *const event_text[] = {
+        " is ready to go ", " is ON the main track going ", " is OFF the main track after going "
+    };
+    int64_t ns = r->ns < 0 ? 0 : r->ns;
+    if (c->hms_len == 0 || ns < c->sec_ns || ns - c->sec_ns >= 1000000000LL) {
+        int64_t secs = ns / 1000000000LL;
+        c->sec_ns = secs * 1000000000LL;
+        c->hms_len = (size_t)snprintf(c->hms, sizeof c->hms, "%02ld:%02ld:%02ld.",
+                                      (long)(secs / 3600), (long)(secs % 3600 / 60), (long)(secs % 60));
+    }
+    size_t len = c->hms_len;
+    memcpy(out, c->hms, len);
+    out[len++] = (char)('0' + (ns - c->sec_ns) / 100000000LL);
+
+    //" Train %2d"
+    memcpy(out + len, " Train ", 7);
+    len += 7;
+    char digits[12];
+    int nd = 0;
+    unsigned int id = (unsigned int)r->id;
+    do {
+        digits[nd++] = (char)('0' + id % 10);
+        id /= 10;
+    } while (id);
+    if (nd < 2) {
+        out[len++] = ' ';
+    }
+    while (nd > 0) {
+        out[len++] = digits[--nd];
+    }
+
+    const char *what = event_text[r->event <= EV_OFF ? r->event : EV_OFF];
+    size_t n = strlen(what);
+    memcpy(out + len, what, n);
+    len += n;
+    memcpy(out + len, dir_text((direction_t)r->dir), 4);
+    len += 4;
+    if (r->event != EV_READY && n_tracks > 1) {
+        len += (size_t)snprintf(out + len, LOG_LINE_MAX - len, " (track %d)", r->track);
+    }
+    out[len++] = '\n';
+    return len;
+}
+
+static int64_t nano_seconds_difference(const struct timespec *now, const struct timespec *then){
+     return (((int64_t)now->tv_sec  - (int64_t)then->tv_sec)  * 1000000000LL + ((int64_t)now->tv_nsec - (int64_t)then->tv_nsec));
+}
+
+/* writev() the whole batch, resuming after short writes. */
+static int writev_all(int fd, struct iovec *iov, int cnt){
+    while (cnt > 0) {
+        ssize_t w = writev(fd, iov, cnt);
+        if (w < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        while (cnt > 0 && (size_t)w >= iov->iov_len) {
+            w -= (ssize_t)iov->iov_len;
+            iov++;
+            cnt--;
+        }
+        if (cnt > 0) {
+            iov->iov_base = (char*)iov->iov_base + w;
+            iov->iov_len -= (size_t)w;
+        }
+    }
+    return 0;
+}
+
+/*
+    Writer thread for the async logger.
+    Takes every published record (up to LOG_BATCH) off the ring at once. With
+    --trace the records go out with one writev() of at most two pieces (the
+    ring may wrap), straight from the ring. Otherwise the batch is formatted
+    into a local buffer, the slots are handed back to producers, and the text
+    goes out in one write. Sleeps on log_wake when the ring is empty and exits
+    once log_stop is set and it is drained.
+*/
+static void* log_writer_main(void *arg){
+    sim_t *sim = (sim_t*)arg;
+    int fd = fileno(sim->outf);
+    stamp_cache stamps = { 0, 0, "" };
+    char text[LOG_BATCH * LOG_LINE_MAX];
+    for (;;) {
+        size_t cnt = 0;
+        while (cnt < LOG_BATCH
+               && atomic_load_explicit(&sim->log_seq[(sim->log_tail + cnt) & (LOG_RING_SLOTS - 1)],
+                                       memory_order_acquire) == sim->log_tail + cnt + 1) {
+            cnt++;
+        }
+        if (cnt > 0) {
+            size_t at = sim->log_tail & (LOG_RING_SLOTS - 1);
+            size_t first = (at + cnt <= LOG_RING_SLOTS) ? cnt : LOG_RING_SLOTS - at;
+            size_t len = 0;
+            if (trace_path) {
+                struct iovec iov[2] = {
+                    { &sim->log_ring[at], first * sizeof(log_rec) },
+                    { &sim->log_ring[0], (cnt - first) * sizeof(log_rec) }
+                };
+                if (writev_all(fd, iov, cnt > first ? 2 : 1) != 0) {
+                    perror(sim->out_path);
+                }
+            }
+            else {
+                for (size_t i = 0; i < cnt; i++) {
+                    len += format_event(&stamps, &sim->log_ring[(sim->log_tail + i) & (LOG_RING_SLOTS - 1)], text + len);
+                }
+            }
+            for (size_t i = 0; i < cnt; i++) {
+                atomic_store_explicit(&sim->log_seq[sim->log_tail & (LOG_RING_SLOTS - 1)],
+                                      sim->log_tail + LOG_RING_SLOTS, memory_order_release);
+                sim->log_tail++;
+            }
+            struct iovec iov = { text, len };
+            if (len > 0 && writev_all(fd, &iov, 1) != 0) {
+                perror(sim->out_path);
+            }
+            continue;
+        }
+
+        //Nothing published: announce we are going idle, then re-check before sleeping
+        atomic_store(&sim->log_writer_idle, 1);
+        if (atomic_load_explicit(&sim->log_seq[sim->log_tail & (LOG_RING_SLOTS - 1)],
+                                 memory_order_acquire) == sim->log_tail + 1) {
+            atomic_store(&sim->log_writer_idle, 0);
+            continue;
+        }
+        if (atomic_load(&sim->log_stop)) {
+            break;
+        }
+        sem_wait(&sim->log_wake);
+    }
+    return NULL;
+}
+
+/* Allocate the record ring and start the writer thread. Returns 0 on success, -1 on error. */
+static int log_start(sim_t *sim){
+    sim->log_ring = (log_rec*)malloc(sizeof(log_rec) * LOG_RING_SLOTS);
+    sim->log_seq = (atomic_size_t*)malloc(sizeof(atomic_size_t) * LOG_RING_SLOTS);
+    if (!sim->log_ring || !sim->log_seq) {
+        fprintf(stderr, "Malloc failed in log_start\n");
+        free(sim->log_ring);
+        free(sim->log_seq);
+        sim->log_ring = NULL;
+        sim->log_seq = NULL;
+        return -1;
+    }
+    for (size_t i = 0; i < LOG_RING_SLOTS; i++) {
+        atomic_init(&sim->log_seq[i], i);
+    }
+    atomic_init(&sim->log_head, 0);
+    atomic_init(&sim->log_writer_idle, 0);
+    atomic_init(&sim->log_stop, 0);
+    sim->log_tail = 0;
+    sem_init(&sim->log_wake, 0, 0);
+    fflush(sim->outf); //nothing may be left in stdio's buffer once writes bypass it
+    if (pthread_create(&sim->log_writer_tid, NULL, log_writer_main, sim) != 0) {
+        perror("pthread_create(logger)");
+        sem_destroy(&sim->log_wake);
+        free(sim->log_ring);
+        free(sim->log_seq);
+        sim->log_ring = NULL;
+        sim->log_seq = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+/*
+    Flush-on-exit: tell the writer no more records are coming and wait until
+    it has written everything still in the ring. Must run after every
+    producer has finished. No-op when the async logger is not running.
+*/
+static void log_finish(sim_t *sim){
+    if (!sim->log_ring) {
+        return;
+    }
+    atomic_store(&sim->log_stop, 1);
+    sem_post(&sim->log_wake);
+    pthread_join(sim->log_writer_tid, NULL);
+    sem_destroy(&sim->log_wake);
+    free(sim->log_ring);
+    free(sim->log_seq);
+    sim->log_ring = NULL;
+    sim->log_seq = NULL;
+}
 
-/* Parsing & Loading Function Prototypes*/
-static int    load_trains(const char *path);
-static int    parse_line(const char *line, int id, train_t *t);
+/* --sync-log: write one record as it is, or as a line. Called with output_mutex held. */
+static void log_write_locked(sim_t *sim, const log_rec *r){
+    if (trace_path) {
+        fwrite(r, sizeof *r, 1, sim->outf);
+    }
+    else {
+        char line[LOG_LINE_MAX];
+        fwrite(line, 1, format_event(&sim->sync_stamps, r, line), sim->outf);
+    }
+    fflush(sim->outf);
+}
 
-/* Train Thread and Dispatcher Function Protoypes*/
-static void*  train_thread(void *arg);
-static void*  dispatcher_main(void *arg);
+/* Copy a record into the slot for ticket pos once the writer has freed it, and wake the writer if needed. */
+static void log_publish(sim_t *sim, size_t pos, const log_rec *r){
+    atomic_size_t *seq = &sim->log_seq[pos & (LOG_RING_SLOTS - 1)];
+    while (atomic_load_explicit(seq, memory_order_acquire) != pos) {
+        sched_yield(); //ring full, writer still draining this record
+    }
+    sim->log_ring[pos & (LOG_RING_SLOTS - 1)] = *r;
+    atomic_store_explicit(seq, pos + 1, memory_order_release);
+    if (atomic_exchange(&sim->log_writer_idle, 0)) {
+        sem_post(&sim->log_wake);
+    }
+}
 
-/* Scheduler Helpers Function Prototypes*/
-static int    any_ready(void);
-static inline int     peek_idx(ready_node *h);
-static inline int64_t peek_ns(ready_node *h);
-static int    choose_from_pair(ready_node **A, ready_node **B);
-static int    choose_next_idx_full(void);
+static log_rec make_rec(int64_t ns, const train_t *t, event_t ev){
+    log_rec r = { ns, t->id, (uint8_t)ev, (uint8_t)t->dir, (uint8_t)(t->track < 0 ? 0 : t->track), (uint8_t)t->high_priority };
+    return r;
+}
 
-/* Ready-Queue Utilities */
-static int    ready_comes_before(int idxA, int64_t nsA, int idxB, int64_t nsB);
-static void   queue_push(ready_node **head, int idx, int64_t ready_ns);
-static int    queue_pop(ready_node **head);
+/*
+    Timestamp service. Reads the clock and claims the log tickets for the
+    given trains (indexes into sim->trains) as one step, so the order of
+    the log is exactly the order the times were taken in. The clock is read
+    between loading log_head and a compare-and-swap that claims the tickets
+    from it. If the swap succeeds, no ticket was claimed in between, so every
+    earlier ticket's clock read came before ours. If it fails, another event
+    got in first and the clock is read again. No lock is taken: a producer
+    only retries when another one claimed a ticket during its clock read.
+    All of the trains get the same stamp, which is returned for the caller
+    to keep. Formatting is left to the writer thread. With --sync-log it is
+    done under output_mutex, which then also orders the events.
+*/
+static int64_t log_now_batch(sim_t *sim, const int *idx, int n, event_t ev){
+    int64_t ns;
+    if (!sim->log_ring) {
+        pthread_mutex_lock(&sim->output_mutex);
+        ns = sim_now(sim);
+        for (int i = 0; i < n; i++) {
+            log_rec r = make_rec(ns, &sim->trains[idx[i]], ev);
+            log_write_locked(sim, &r);
+        }
+        pthread_mutex_unlock(&sim->output_mutex);
+        return ns;
+    }
+    size_t pos = atomic_load_explicit(&sim->log_head, memory_order_acquire);
+    do {
+        ns = sim_now(sim);
+    } while (!atomic_compare_exchange_weak_explicit(&sim->log_head, &pos, pos + (size_t)n,
+                                                    memory_order_acq_rel, memory_order_acquire));
+    for (int i = 0; i < n; i++) {
+        log_rec r = make_rec(ns, &sim->trains[idx[i]], ev);
+        log_publish(sim, pos + (size_t)i, &r);
+    }
+    return ns;
+}
 
-/* Timing and Outputs Function Prototypes */
-static int64_t nano_seconds_difference(const struct timespec *now, const struct timespec *then);
-void format_elapsed(char *buf, size_t n);
-void write_linef(const char *fmt, ...);
-static const char* dir_text(direction_t d);
+/* Log one event for t at the current time and return that time. */
+static int64_t log_now(sim_t *sim, const train_t *t, event_t ev){
+    int idx = (int)(t - sim->trains);
+    return log_now_batch(sim, &idx, 1, ev);
+}
 
-int main(int argc, char **argv){
-    if(argc != 2){
-        fprintf(stderr, "Usage: %s input.txt\n", argv[0]);
-        return 1;
+/*
+    Log one event with a time the caller already has, for the single
+    threaded --virtual-time engine, whose clock only it moves.
+*/
+static void log_event(sim_t *sim, int64_t ns, const train_t *t, event_t ev){
+    log_rec r = make_rec(ns, t, ev);
+    if (sim->log_ring) {
+        log_publish(sim, atomic_fetch_add_explicit(&sim->log_head, 1, memory_order_relaxed), &r);
+        return;
     }
+    pthread_mutex_lock(&sim->output_mutex);
+    log_write_locked(sim, &r);
+    pthread_mutex_unlock(&sim->output_mutex);
+}
 
-    outf = fopen("output.txt","w");
-    if(!outf){
-        perror("output.txt");
-        return 1;
+/* --trace: start the file with its header. Returns 0 on success, -1 on a write error. */
+static int write_trace_header(sim_t *sim){
+    trace_header h;
+    memset(&h, 0, sizeof h);
+    memcpy(h.magic, TRACE_MAGIC, sizeof h.magic);
+    h.version = TRACE_VERSION;
+    h.rec_size = sizeof(log_rec);
+    h.n_tracks = (uint16_t)n_tracks;
+    return (fwrite(&h, sizeof h, 1, sim->outf) == 1 && fflush(sim->outf) == 0) ? 0 : -1;
+}
+
+/* HDR-style bucket for a value: exact below 16, then 16 sub-buckets per power of two. */
+static int hist_bucket(int64_t v){
+    if (v < (1 << HIST_SUB_BITS)) {
+        return v < 0 ? 0 : (int)v;
     }
+    int e = 63 - __builtin_clzll((unsigned long long)v);
+    int sub = (int)((v >> (e - HIST_SUB_BITS)) & ((1 << HIST_SUB_BITS) - 1));
+    return ((e - HIST_SUB_BITS + 1) << HIST_SUB_BITS) + sub;
+}
 
-    if(load_trains(argv[1]) != 0){
-        fprintf(stderr, "Failed to parse input file: %s\n", argv[1]);
-        fclose(outf);
-        return 1;
+/* Smallest value that falls in bucket b */
+static int64_t hist_lower(int b){
+    if (b < (1 << HIST_SUB_BITS)) {
+        return b;
     }
+    int e = (b >> HIST_SUB_BITS) + HIST_SUB_BITS - 1;
+    int64_t sub = b & ((1 << HIST_SUB_BITS) - 1);
+    return (((int64_t)1 << HIST_SUB_BITS) + sub) << (e - HIST_SUB_BITS);
+}
 
-    clock_gettime(CLOCK_MONOTONIC, &start);
+static int cmp_int64(const void *a, const void *b){
+    int64_t x = *(const int64_t*)a, y = *(const int64_t*)b;
+    return (x > y) - (x < y);
+}
 
-    pthread_t dispatcher_tid;
-    if(pthread_create(&dispatcher_tid, NULL, dispatcher_main, NULL) != 0){
-        perror("pthread_create(dispatcher)");
-        fclose(outf);
-        free(trains);
-        return 1;
+/* Emit one latency object: exact percentiles plus the non-empty histogram buckets. */
+static void write_latency_stats(FILE *f, const char *name, int64_t *v, int n, const char *sep){
+    qsort(v, (size_t)n, sizeof *v, cmp_int64);
+    int64_t sum = 0;
+    for (int i = 0; i < n; i++) {
+        sum += v[i];
     }
-
-    for(int i = 0; i < n_trains; i++){
-        if(pthread_create(&trains[i].tid, NULL, train_thread, &trains[i]) != 0){
-            perror("pthread_create(train)");
-            //cleanup already-started trains
-            for (int j = 0; j < i; j++) {
-                pthread_join(trains[j].tid, NULL);
-                pthread_cond_destroy(&trains[j].cv);
+    static const double pct[] = { 50.0, 90.0, 99.0, 99.9 };
+    static const char *pct_name[] = { "p50", "p90", "p99", "p999" };
+    fprintf(f, "    \"%s\": {\"count\": %d", name, n);
+    if (n > 0) {
+        fprintf(f, ", \"min\": %lld, \"mean\": %lld, \"max\": %lld",
+                (long long)v[0], (long long)(sum / n), (long long)v[n - 1]);
+        for (int i = 0; i < 4; i++) {
+            int at = (int)((pct[i] / 100.0) * n + 0.999999) - 1; //nearest rank
+            if (at < 0) {
+                at = 0;
             }
-            pthread_cancel(dispatcher_tid);
-            pthread_join(dispatcher_tid, NULL);
-            fclose(outf);
-            free(trains);
-            return 1;
+            fprintf(f, ", \"%s\": %lld", pct_name[i], (long long)v[at]);
         }
     }
-
-    for (int i = 0; i < n_trains; i++){
-        pthread_join(trains[i].tid, NULL);
-        pthread_cond_destroy(&trains[i].cv);
+    fprintf(f, ",\n      \"histogram\": [");
+    int first = 1;
+    for (int i = 0; i < n; ) {
+        int b = hist_bucket(v[i]);
+        int count = 0;
+        while (i < n && hist_bucket(v[i]) == b) {
+            count++;
+            i++;
+        }
+        fprintf(f, "%s{\"from\": %lld, \"to\": %lld, \"count\": %d}", first ? "" : ", ",
+                (long long)hist_lower(b), (long long)hist_lower(b + 1), count);
+        first = 0;
     }
+    fprintf(f, "]}%s\n", sep);
+}
 
-    pthread_join(dispatcher_tid, NULL);
-
-    fclose(outf);
-    free(trains);
-    return 0;
+/* One crossing, for the busy-time sweep in write_metrics */
+typedef struct {
+    int64_t on_ns, off_ns;
+    int track;
+    int dir;
+} crossing_span;
+
+static int cmp_span_on(const void *a, const void *b){
+    int64_t x = ((const crossing_span*)a)->on_ns, y = ((const crossing_span*)b)->on_ns;
+    return (x > y) - (x < y);
 }
 
 /*
-    Read the input file and build the trains[] array.
-    Counts lines first to know how many trains to allocate, then re-reads and parses each line.
-    On success sets n_trains and returns 0; on error returns -1
+    Add [on, off) to a union of intervals swept in ON order, whose right
+    edge so far is *end. Returns how much time the new interval adds.
 */
-
-static int load_trains(const char *path) {
-    FILE *f = fopen(path, "r");
-    if (!f) { 
-        perror("fopen"); 
-        return -1; 
+static int64_t span_extend(int64_t *end, int64_t on, int64_t off){
+    if (off <= *end) {
+        return 0;
     }
+    int64_t added = off - (on > *end ? on : *end);
+    *end = off;
+    return added;
+}
 
-    int count = 0;
-    char buf[256];
-
-    //Count Number of Lines/Trains
-    while (fgets(buf, sizeof(buf), f)){      
-        char *p = buf;
-        while (*p == ' ' || *p == '\t'){
-            p++;
-        }
-        if (*p == '\0' || *p == '\n'){
-            continue;   // skip blank lines 
-        }
-        count++;
+/*
+    --metrics: write per-run scheduling metrics as JSON. Covers ready->ON
+    wait per priority class (exact percentiles and HDR-style histograms),
+    dispatch latency (actual ON against the earliest possible ON),
+    per-direction throughput, per-track busy/idle time and how often the
+    two-in-a-row balancing rule fired. All times are simulated nanoseconds.
+    Returns 0 on success, -1 on error.
+*/
+static int write_metrics(sim_t *sim, const char *path){
+    FILE *f = fopen(path, "w");
+    if (!f) {
+        perror(path);
+        return -1;
     }
-    
-    //If the number of lines (count) is 0, then its an empty file*/
-    if (count == 0) {                                  
+    int64_t *waits = (int64_t*)malloc(sizeof(int64_t) * (size_t)(sim->n_trains > 0 ? sim->n_trains : 1));
+    if (!waits) {
+        fprintf(stderr, "Malloc failed in write_metrics\n");
         fclose(f);
-        n_trains = 0;
-        return 0;
+        return -1;
+    }
+
+    int64_t makespan = 0;
+    int dir_count[2] = {0, 0};
+    int track_count[MAX_TRACKS] = {0};
+    for (int i = 0; i < sim->n_trains; i++) {
+        const train_t *t = &sim->trains[i];
+        if (t->off_ns > makespan) {
+            makespan = t->off_ns;
+        }
+        dir_count[t->dir]++;
+        track_count[t->track]++;
     }
 
-    //Dynammic Memory Allocation of the Trains (with the size as count)
-    rewind(f);
-    trains = (train_t*)calloc((size_t)count, sizeof(train_t));
-    if (!trains) {
+    //Busy time is the union of the [ON, OFF) intervals: with --convoy, crossings on a track overlap
+    int64_t dir_busy[2] = {0, 0};
+    int64_t track_busy[MAX_TRACKS] = {0};
+    crossing_span *spans = (crossing_span*)malloc(sizeof(crossing_span) * (size_t)(sim->n_trains > 0 ? sim->n_trains : 1));
+    if (!spans) {
+        fprintf(stderr, "Malloc failed in write_metrics\n");
+        free(waits);
         fclose(f);
-        fprintf(stderr, "Calloc failed in load_trains\n");
         return -1;
     }
-
-    int id = 0;
-    int ok = 1; //Flagging for failed parse
-    while (id < count && fgets(buf, sizeof(buf), f)){
-        if (parse_line(buf, id, &trains[id]) != 0){
-            fprintf(stderr, "Parse error on line %d: %s", id + 1, buf);
-            ok = 0;
-            break;
+    for (int i = 0; i < sim->n_trains; i++) {
+        const train_t *t = &sim->trains[i];
+        spans[i] = (crossing_span){ t->on_ns, t->off_ns, t->track, t->dir };
+    }
+    qsort(spans, (size_t)sim->n_trains, sizeof *spans, cmp_span_on);
+    int64_t dir_end[MAX_TRACKS][2] = {{0}}; //a direction's busy time is summed over tracks
+    int64_t track_end[MAX_TRACKS] = {0};
+    for (int i = 0; i < sim->n_trains; i++) {
+        const crossing_span *c = &spans[i];
+        track_busy[c->track] += span_extend(&track_end[c->track], c->on_ns, c->off_ns);
+        dir_busy[c->dir] += span_extend(&dir_end[c->track][c->dir], c->on_ns, c->off_ns);
+    }
+    free(spans);
+
+    fprintf(f, "{\n  \"trains\": %d,\n  \"tracks\": %d,\n  \"makespan_ns\": %lld,\n",
+            sim->n_trains, n_tracks, (long long)makespan);
+    fprintf(f, "  \"streak_rule\": {\"fired\": %ld, \"opposite_empty\": %ld},\n",
+            sim->streak_rule_fired, sim->streak_rule_skipped);
+    fprintf(f, "  \"convoy\": {\"headway_ns\": %lld, \"followers\": %ld},\n",
+            (long long)(convoy ? convoy_headway_ns : 0), sim->convoy_followers);
+    fprintf(f, "  \"directions\": {\n");
+    for (int d = 0; d < 2; d++) {
+        double per_sec = makespan > 0 ? dir_count[d] / ((double)makespan / 1e9) : 0.0;
+        fprintf(f, "    \"%s\": {\"trains\": %d, \"busy_ns\": %lld, \"trains_per_second\": %.4f}%s\n",
+                dir_text((direction_t)d), dir_count[d], (long long)dir_busy[d], per_sec, d == 0 ? "," : "");
+    }
+    fprintf(f, "  },\n  \"track_usage\": [\n");
+    for (int k = 0; k < n_tracks; k++) {
+        fprintf(f, "    {\"track\": %d, \"trains\": %d, \"busy_ns\": %lld, \"idle_ns\": %lld}%s\n",
+                k, track_count[k], (long long)track_busy[k], (long long)(makespan - track_busy[k]),
+                k + 1 < n_tracks ? "," : "");
+    }
+    fprintf(f, "  ],\n  \"wait_ns\": {\n");
+    for (int high = 1; high >= 0; high--) {
+        int n = 0;
+        for (int i = 0; i < sim->n_trains; i++) {
+            if (sim->trains[i].high_priority == high) {
+                waits[n++] = sim->trains[i].on_ns - sim->trains[i].ready_time_ns;
+            }
         }
-        id++;         
+        write_latency_stats(f, high ? "high" : "low", waits, n, high ? "," : "");
     }
-    fclose(f);
-    if (!ok) {
-        free(trains);
-        trains = NULL;
-        n_trains = 0;
+    //How late each ON was against the moment the train could first have gone on
+    fprintf(f, "  },\n  \"dispatch_ns\": {\n");
+    for (int i = 0; i < sim->n_trains; i++) {
+        waits[i] = sim->trains[i].on_ns - sim->trains[i].on_deadline_ns;
+    }
+    write_latency_stats(f, "all", waits, sim->n_trains, "");
+    fprintf(f, "  }\n}\n");
+
+    free(waits);
+    if (fclose(f) != 0) {
+        perror(path);
         return -1;
     }
-    n_trains = id;
     return 0;
 }
 
+static const char* dir_text(direction_t d){ 
+    if(d == EAST){
+        return "East";
+    }
+    else{
+        return "West";
+    }
+}
+
 /*
-    Parse one train description line (e.g. "E 3 4") into a train_t record.
-    Validates direction and that loading/crossing times are in 1..99, then initializes
-    the per-train fields (id, dir, priority, times) and its condition variable.
+    Size each ready queue from the number of trains in its class and carve its
+    heap storage out of a single pool of n_trains entries (plus room for
+    promoted trains under --policy aging), so pushes never allocate.
+    Returns 0 on success, -1 if the pool cannot be allocated.
 */
-
-static int parse_line(const char *line, int id, train_t *t) {
-    char c; 
-    int load, cross;
-    if (sscanf(line, " %c %d %d", &c, &load, &cross) != 3){
-        return -1;
+static int init_queues(sim_t *sim){
+    int count[4] = {0, 0, 0, 0};
+    for(int i = 0; i < sim->n_trains; i++){
+        count[sim->trains[i].dir * 2 + sim->trains[i].high_priority]++;
     }
-    if (load < 1 || load > 99 || cross < 1 || cross > 99){
+    int cap[4] = { count[0], count[1], count[2], count[3] };
+    if(policy->promotes){
+        //High queues may also have to hold every promoted low train of their direction
+        cap[1] += count[0];
+        cap[3] += count[2];
+    }
+    size_t total = (size_t)(cap[0] + cap[1] + cap[2] + cap[3]);
+    sim->ready_pool = (ready_entry*)malloc(sizeof(ready_entry) * (total > 0 ? total : 1));
+    if(!sim->ready_pool){
+        fprintf(stderr, "Malloc failed in init_queues\n");
         return -1;
     }
-
-    int high = 0;
-    switch (c) {
-        case 'e': high = 0; t->dir = EAST; break;
-        case 'E': high = 1; t->dir = EAST; break;
-        case 'w': high = 0; t->dir = WEST; break;
-        case 'W': high = 1; t->dir = WEST; break;
-        default: return -1;
+    for(int c = 0; c < 4; c++){
+        atomic_init(&sim->inbox[c], -1);
+    }
+    atomic_init(&sim->dispatcher_idle, 0);
+    ready_queue *qs[4] = { &sim->east_low, &sim->east_high, &sim->west_low, &sim->west_high };
+    ready_entry *slot = sim->ready_pool;
+    for(int c = 0; c < 4; c++){
+        qs[c]->heap = slot;
+        qs[c]->size = 0;
+        qs[c]->cap = cap[c];
+        slot += cap[c];
     }
-
-    t->id = id;
-    t->high_priority = high;
-    t->loading_time = load;
-    t->crossing_time = cross;
-    t->ready_time_ns = -1;
-    t->my_turn = 0;
-    pthread_cond_init(&t->cv, NULL);
     return 0;
 }
 
-/* 
-    Thread routine for a single train.
-    Simulates loading, announces “ready”, enqueues itself in the correct
-    priority/direction queue, then waits until the dispatcher chooses it.
-    When dispatched, it logs ON/OFF around the crossing, updates global
-    scheduling state, and wakes the dispatcher to pick the next train.
- */ 
-
-static void* train_thread(void *arg){
-    //Cast void* -> train_t* to use its fields
-    train_t *t = (train_t*)arg;
-
-    //Simulate Loading
-    usleep(t->loading_time * 100000);
-
-    //Stamp Ready time
-    struct timespec now;
-    clock_gettime(CLOCK_MONOTONIC, &now);
-    t->ready_time_ns = nano_seconds_difference(&now, &start);
-
-    //Log the Train Ready Line
-    char timestamp[32];
-    format_elapsed(timestamp, sizeof timestamp);
-    write_linef("%s Train %2d is ready to go %4s\n", timestamp, t->id, dir_text(t->dir));
-
-    //Enqueue, notify dispatcher and wait
-    pthread_mutex_lock(&scheduling_mutex);
-    ready_node **q = NULL;
+/* Ready queue matching a train's direction and priority. */
+static ready_queue* class_queue(sim_t *sim, const train_t *t){
     if(t->dir == EAST){
-        q = (t->high_priority ? &east_high : &east_low);
-    }
-    else{
-        q = (t->high_priority ? &west_high : &west_low);
-    }
-    queue_push(q, t->id, t->ready_time_ns);
-    pthread_cond_signal(&ready_cv);
-    while (!t->my_turn) {
-        pthread_cond_wait(&t->cv, &scheduling_mutex);
-    }
-    //Enter track
-    pthread_mutex_unlock(&scheduling_mutex);
-
-    //ON -> Cross -> Off
-    format_elapsed(timestamp, sizeof timestamp);
-    write_linef("%s Train %2d is ON the main track going %4s\n", timestamp, t->id, dir_text(t->dir));
-
-    usleep(t->crossing_time * 100000);
-
-    format_elapsed(timestamp, sizeof timestamp);
-    write_linef("%s Train %2d is OFF the main track after going %4s\n", timestamp, t->id, dir_text(t->dir));
-
-    //Free track and wake dispatcher 
-    pthread_mutex_lock(&scheduling_mutex);
-    track_in_use = 0;
-    pthread_cond_signal(&ready_cv);
-
-    // update streak + counters WHILE holding the lock
-    have_ever_crossed = 1;
-    if (t->dir == last_dir){
-        same_dir_streak++;
-    }
-    else { 
-        last_dir = t->dir; same_dir_streak = 1; 
+        return (t->high_priority ? &sim->east_high : &sim->east_low);
     }
-    trains_finished++;
-    pthread_cond_broadcast(&ready_cv);
-    pthread_mutex_unlock(&scheduling_mutex);
-    return NULL;
+    return (t->high_priority ? &sim->west_high : &sim->west_low);
 }
 
-/* 
-    Dispatcher thread.
-    Waits until at least one train is ready and the track is free, then
-    selects the next train according to the scheduling rules (priority,
-    direction balancing, tie-breaking), marks the track as in use, and
-    signals exactly that train’s condition variable. Runs until all trains
-    have finished.
- */
-
-
-static void* dispatcher_main(void *arg) {
-    (void)arg;
-    pthread_mutex_lock(&scheduling_mutex);
-    while (trains_finished < n_trains) {
-        while ((!any_ready() || track_in_use) && trains_finished < n_trains) {
-            pthread_cond_wait(&ready_cv, &scheduling_mutex);
-        }
-        if (trains_finished >= n_trains){
-            break;
-        }
+/*
+    Publish a ready train to its class inbox with a single CAS. Only the
+    dispatcher consumes, and it always takes the whole list, so no ABA.
+*/
+static void inbox_push(sim_t *sim, train_t *t){
+    atomic_int *head = &sim->inbox[t->dir * 2 + t->high_priority];
+    int next = atomic_load_explicit(head, memory_order_relaxed);
+    do {
+        t->inbox_next = next;
+    } while (!atomic_compare_exchange_weak_explicit(head, &next, t->id,
+                                                    memory_order_release, memory_order_relaxed));
+}
 
-        int idx = choose_next_idx_full();
-        if (idx >= 0) {
-            track_in_use = 1;
-            trains[idx].my_turn = 1;
-            pthread_cond_signal(&trains[idx].cv);
+/*
+    Move every train waiting in the inboxes into its ready queue. Called with
+    scheduling_mutex held. Returns how many trains were moved.
+*/
+static int drain_inboxes(sim_t *sim){
+    int moved = 0;
+    for (int c = 0; c < 4; c++) {
+        int id = atomic_exchange_explicit(&sim->inbox[c], -1, memory_order_acquire);
+        while (id >= 0) {
+            train_t *t = &sim->trains[id];
+            queue_push(sim, class_queue(sim, t), id, t->ready_time_ns);
+            id = t->inbox_next;
+            moved++;
         }
     }
-    pthread_mutex_unlock(&scheduling_mutex);
-    return NULL;
+    return moved;
 }
 
-void format_elapsed(char *buf, size_t n){
-    struct timespec now;
-    clock_gettime(CLOCK_MONOTONIC, &now);
-    
-    int64_t ns = nano_seconds_difference(&now, &start);
-    int64_t total_ms = ns / 1000000LL; //milliseconds
-
-    long hours = (long)(total_ms / 3600000LL); //60 * 60 * 1000
-    total_ms = total_ms % 3600000LL;
-
-    long mins = (long)(total_ms / 60000LL); //60 * 1000
-    total_ms = total_ms % 60000LL;
-
-    long secs   = (long)(total_ms / 1000LL);
-    long tenths = (long)((total_ms % 1000LL) / 100LL); // 0..9
-
-    snprintf(buf, n, "%02ld:%02ld:%02ld.%1ld", hours, mins, secs, tenths);
+/*
+    Wake the dispatcher after an inbox push, but only if it is waiting for
+    trains; a burst of ready trains takes scheduling_mutex once, not once each.
+*/
+static void wake_dispatcher(sim_t *sim){
+    if (atomic_exchange(&sim->dispatcher_idle, 0)) {
+        pthread_mutex_lock(&sim->scheduling_mutex);
+        pthread_cond_signal(&sim->ready_cv);
+        pthread_mutex_unlock(&sim->scheduling_mutex);
+    }
 }
 
-static int64_t nano_seconds_difference(const struct timespec *now, const struct timespec *then){
-     return (((int64_t)now->tv_sec  - (int64_t)then->tv_sec)  * 1000000000LL + ((int64_t)now->tv_nsec - (int64_t)then->tv_nsec));
+/* Heap order: crossing_time first if keyed (a constant at every call), then ready_comes_before. */
+static inline int entry_before_by(const ready_entry *a, const ready_entry *b, int keyed){
+    if (keyed && a->key != b->key) {
+        return a->key < b->key;
+    }
+    return ready_comes_before(a->idx, a->ready_ns, b->idx, b->ready_ns);
 }
 
-void write_linef(const char *fmt, ...) {
-    char buf[550];                    
-    va_list ap;
-    va_start(ap, fmt);
-    int n = vsnprintf(buf, sizeof(buf), fmt, ap);
-    va_end(ap);
-
-    if (n < 0){
-        return;
-    }                 
-    size_t len = (size_t)((n < (int)sizeof(buf)) ? n : (int)sizeof(buf)-1);
-    pthread_mutex_lock(&output_mutex);
-    fwrite(buf, 1, len, outf);      
-    fflush(outf);                   
-    pthread_mutex_unlock(&output_mutex);
-}
+#define entry_before(a, b) (KEY_BY_CROSSING ? entry_before_by(a, b, 1) : entry_before_by(a, b, 0))
 
-static const char* dir_text(direction_t d){ 
-    if(d == EAST){
-        return "East";
-    }
-    else{
-        return "West";
+/* Push (idx, ready_ns) into the heap, sifting it up to keep the earliest entry at the root. */
+static inline void queue_push_by(sim_t *sim, ready_queue *q, int idx, int64_t ready_ns, int keyed) {
+    ready_entry e = { idx, ready_ns, keyed ? sim->trains[idx].crossing_time : 0 };
+    int i = q->size++;
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        if (!entry_before_by(&e, &q->heap[parent], keyed)) {
+            break;
+        }
+        q->heap[i] = q->heap[parent];
+        i = parent;
     }
+    q->heap[i] = e;
 }
 
-/*Push (idx, ready_ns) into a singly linked list, keeping it sorted. */
-static void queue_push(ready_node **head, int idx, int64_t ready_ns) {
-    ready_node *n = (ready_node*)malloc(sizeof(ready_node));
-    n->idx = idx;
-    n->ready_ns = ready_ns;
-    n->next = NULL;
-
-    ready_node *cur = *head, *prev = NULL;
-    while (cur && !ready_comes_before(idx, ready_ns, cur->idx, cur->ready_ns)) {
-        prev = cur;
-        cur = cur->next;
+static void queue_push(sim_t *sim, ready_queue *q, int idx, int64_t ready_ns) {
+    if (KEY_BY_CROSSING) {
+        queue_push_by(sim, q, idx, ready_ns, 1);
     }
-    if (prev == NULL) {  //insert at head
-        n->next = *head;
-        *head = n;
-    } else {  // insert after prev
-        n->next = prev->next;
-        prev->next = n;
+    else {
+        queue_push_by(sim, q, idx, ready_ns, 0);
     }
 }
 
-/* Pop head, returns idx or -1 if empty. */
-static int queue_pop(ready_node **head) {
-    if (*head == NULL){
+/* Pop the root, returns idx or -1 if empty. */
+static inline int queue_pop_by(ready_queue *q, int keyed) {
+    if (q->size == 0){
         return -1;
     }
-    ready_node *n = *head;
-    int idx = n->idx;
-    *head = n->next;
-    free(n);
+    int idx = q->heap[0].idx;
+    ready_entry last = q->heap[--q->size];
+    int i = 0;
+    for (;;) {
+        int child = 2 * i + 1;
+        if (child >= q->size) {
+            break;
+        }
+        if (child + 1 < q->size && entry_before_by(&q->heap[child + 1], &q->heap[child], keyed)) {
+            child++;
+        }
+        if (!entry_before_by(&q->heap[child], &last, keyed)) {
+            break;
+        }
+        q->heap[i] = q->heap[child];
+        i = child;
+    }
+    q->heap[i] = last;
     return idx;
 }
 
+static int queue_pop(ready_queue *q) {
+    return KEY_BY_CROSSING ? queue_pop_by(q, 1) : queue_pop_by(q, 0);
+}
+
 /* Returns 1 if (idxA, nsA) should appear before (idxB, nsB) in the queue. */
 static int ready_comes_before(int idxA, int64_t nsA, int idxB, int64_t nsB) {
     if (nsA < nsB){
@@ -434,15 +2299,15 @@ static int ready_comes_before(int idxA, int64_t nsA, int idxB, int64_t nsB) {
     return idxA < idxB;
 }
 
-static int any_ready(void){
-    return (east_high || east_low || west_high || west_low);
+static int any_ready(sim_t *sim){
+    return (sim->east_high.size || sim->east_low.size || sim->west_high.size || sim->west_low.size);
 }
 
-static int choose_from_pair(ready_node **A, ready_node **B) {
-    int ai = peek_idx(*A);
-    int bi = peek_idx(*B);
+static int choose_from_pair(ready_queue *A, ready_queue *B) {
+    int ai = peek_idx(A);
+    int bi = peek_idx(B);
     if (ai >= 0 && bi >= 0) {
-        if (ready_comes_before(ai, peek_ns(*A), bi, peek_ns(*B))){
+        if (entry_before(&A->heap[0], &B->heap[0])){
             return queue_pop(A);
         }
         else{
@@ -458,40 +2323,158 @@ static int choose_from_pair(ready_node **A, ready_node **B) {
     return -1;
 }
 
-static int choose_next_idx_full(void) {
+/*
+    Direction rules in effect for a track: its own when --track-rules is
+    per-track, otherwise the state shared by every track.
+*/
+static sched_state_t* rules_for(sim_t *sim, int track){
+    return per_track_rules ? &sim->tracks[track].rules : &sim->global_rules;
+}
+
+/* Advance the two-in-a-row streak after a train in direction dir leaves a track. */
+static void note_crossed(sched_state_t *st, direction_t dir){
+    st->have_ever_crossed = 1;
+    if (dir == st->last_dir){
+        st->same_dir_streak++;
+    }
+    else {
+        st->last_dir = dir; st->same_dir_streak = 1;
+    }
+}
+
+/*
+    Put a dispatched train on track k and fix when it leaves. The crossing
+    starts, in simulated time, once the train has loaded and the previous
+    train on the track has left; so back-to-back crossings are laid end to
+    end on the clock instead of accumulating each handoff's delay.
+*/
+static void schedule_crossing(sim_t *sim, train_t *t, int k){
+    int64_t on_ns = t->loading_time * TENTH_NS;
+    if (sim->tracks[k].free_at_ns > on_ns) {
+        on_ns = sim->tracks[k].free_at_ns;
+    }
+    t->track = k;
+    t->on_deadline_ns = on_ns;
+    t->off_deadline_ns = on_ns + t->crossing_time * TENTH_NS;
+    sim->tracks[k].dir = t->dir;
+    sim->tracks[k].last_on_ns = on_ns;
+    sim->tracks[k].free_at_ns = t->off_deadline_ns;
+}
+
+/*
+    --convoy: let a ready train follow the trains already on busy track k.
+    The follower travels the same way, enters at least one headway after
+    the train ahead and before the track empties, and cannot leave sooner
+    than one headway behind it. Nobody joins once convoy_max trains share the
+    track, or while an opposing train at the head of its queue has waited
+    convoy_bound_ns. High priority joins before low. Called with
+    scheduling_mutex held; returns the scheduled train's index, or -1.
+*/
+static int convoy_follower(sim_t *sim, int k){
+    track_t *tr = &sim->tracks[k];
+    if (tr->occupants == 0 || tr->occupants >= convoy_max) {
+        return -1;
+    }
+    ready_queue *high = (tr->dir == EAST) ? &sim->east_high : &sim->west_high;
+    ready_queue *low = (tr->dir == EAST) ? &sim->east_low : &sim->west_low;
+    ready_queue *q = high->size ? high : low;
+    if (!q->size) {
+        return -1;
+    }
+
+    int64_t now = policy_now(sim);
+    ready_queue *opposing[2] = { (tr->dir == EAST) ? &sim->west_high : &sim->east_high,
+                                 (tr->dir == EAST) ? &sim->west_low : &sim->east_low };
+    for (int i = 0; i < 2; i++) {
+        if (opposing[i]->size && now - opposing[i]->heap[0].ready_ns >= convoy_bound_ns) {
+            return -1;
+        }
+    }
+
+    train_t *t = &sim->trains[q->heap[0].idx];
+    int64_t on_ns = t->loading_time * TENTH_NS;
+    if (tr->last_on_ns + convoy_headway_ns > on_ns) {
+        on_ns = tr->last_on_ns + convoy_headway_ns;
+    }
+    if (now > on_ns) {
+        on_ns = now;
+    }
+    if (on_ns >= tr->free_at_ns) {
+        return -1; //track empties first: the normal rules pick who goes next
+    }
+    int64_t off_ns = on_ns + t->crossing_time * TENTH_NS;
+    if (tr->free_at_ns + convoy_headway_ns > off_ns) {
+        off_ns = tr->free_at_ns + convoy_headway_ns;
+    }
+
+    queue_pop(q);
+    t->track = k;
+    t->on_deadline_ns = on_ns;
+    t->off_deadline_ns = off_ns;
+    tr->occupants++;
+    tr->last_on_ns = on_ns;
+    tr->free_at_ns = off_ns;
+    sim->convoy_followers++;
+    return t->id;
+}
+
+/* Mark the lowest-numbered free track as in use and return it. Caller checks free_tracks > 0. */
+static int claim_free_track(sim_t *sim){
+    for (int k = 0; k < n_tracks; k++) {
+        if (sim->tracks[k].occupants == 0) {
+            sim->tracks[k].occupants = 1;
+            sim->free_tracks--;
+            return k;
+        }
+    }
+    return -1;
+}
+
+/*
+    Default policy (fcfs): first train goes West, switch direction after two
+    in a row, then high before low and earliest ready (lowest ID on ties).
+    Also serves sjf, whose queues are ordered by crossing_time instead.
+*/
+static int choose_next_idx_full(sim_t *sim, sched_state_t *st) {
     // First train ever: prefer WEST if any ready
-    if (!have_ever_crossed) {
-        if (west_high || west_low) {
-            if (west_high){
-                return queue_pop(&west_high);
+    if (!st->have_ever_crossed) {
+        if (sim->west_high.size || sim->west_low.size) {
+            if (sim->west_high.size){
+                return queue_pop(&sim->west_high);
             }
-            if (west_low){
-                return queue_pop(&west_low);
+            if (sim->west_low.size){
+                return queue_pop(&sim->west_low);
             }
         }
         //else fall back to EAST normally below
     }
 
     //Direction balancing after two same-direction trains
-    int want_opposite = (same_dir_streak >= 2);
+    int want_opposite = (st->same_dir_streak >= 2);
 
     if (want_opposite) {
-        if (last_dir == EAST) {
-            if (west_high || west_low) {
-                if (west_high){
-                    return queue_pop(&west_high);
+        if ((st->last_dir == EAST) ? (sim->west_high.size || sim->west_low.size) : (sim->east_high.size || sim->east_low.size)) {
+            sim->streak_rule_fired++;
+        }
+        else {
+            sim->streak_rule_skipped++;
+        }
+        if (st->last_dir == EAST) {
+            if (sim->west_high.size || sim->west_low.size) {
+                if (sim->west_high.size){
+                    return queue_pop(&sim->west_high);
                 }
-                if (west_low){
-                    return queue_pop(&west_low);
+                if (sim->west_low.size){
+                    return queue_pop(&sim->west_low);
                 }
             }
         } else {
-            if (east_high || east_low) {
-                if (east_high){
-                    return queue_pop(&east_high);
+            if (sim->east_high.size || sim->east_low.size) {
+                if (sim->east_high.size){
+                    return queue_pop(&sim->east_high);
                 }
-                if (east_low){
-                    return queue_pop(&east_low);
+                if (sim->east_low.size){
+                    return queue_pop(&sim->east_low);
                 }
             }
         }
@@ -499,21 +2482,86 @@ static int choose_next_idx_full(void) {
     }
 
     // Normal priority + tie rules
-    if (east_high || west_high){
-        return choose_from_pair(&east_high, &west_high);
+    if (sim->east_high.size || sim->west_high.size){
+        return choose_from_pair(&sim->east_high, &sim->west_high);
     }
-    if (east_low  || west_low ){
-        return choose_from_pair(&east_low,  &west_low );
+    if (sim->east_low.size || sim->west_low.size){
+        return choose_from_pair(&sim->east_low,  &sim->west_low );
     }
     return -1;
 }
 
-/* Queue Peak Helper Functions */
-static inline int peek_idx(ready_node *h){
-    return (h ? h->idx : -1);
+/*
+    Weighted fair queuing between directions (--policy wfq).
+    Priority still comes first: high-priority trains go before low ones,
+    as under fcfs. Within the chosen priority level the
+    direction whose next train would finish earliest in weighted service
+    time goes next, so with weights E:W the track is shared in that ratio
+    while both directions have trains waiting. A direction that sat idle
+    is brought up to the other's service time so it cannot bank credit.
+*/
+static int choose_wfq(sim_t *sim, sched_state_t *st) {
+    ready_queue *q[2];
+    if (sim->east_high.size || sim->west_high.size) {
+        q[EAST] = &sim->east_high; q[WEST] = &sim->west_high;
+    }
+    else {
+        q[EAST] = &sim->east_low; q[WEST] = &sim->west_low;
+    }
+    if (!q[EAST]->size && !q[WEST]->size) {
+        return -1;
+    }
+
+    int64_t finish[2];
+    for (int d = 0; d < 2; d++) {
+        if (!q[d]->size && st->wfq_vtime[d] < st->wfq_vtime[!d]) {
+            st->wfq_vtime[d] = st->wfq_vtime[!d]; //idle direction: no banked credit
+        }
+    }
+    for (int d = 0; d < 2; d++) {
+        finish[d] = q[d]->size
+            ? st->wfq_vtime[d] + sim->trains[q[d]->heap[0].idx].crossing_time * 1000 / wfq_weight[d]
+            : INT64_MAX;
+    }
+
+    int d;
+    if (finish[EAST] != finish[WEST]) {
+        d = (finish[EAST] < finish[WEST]) ? EAST : WEST;
+    }
+    else {
+        d = entry_before(&q[EAST]->heap[0], &q[WEST]->heap[0]) ? EAST : WEST;
+    }
+    st->wfq_vtime[d] = finish[d];
+    return queue_pop(q[d]);
+}
+
+/*
+    Aging priority boost (--policy aging).
+    A low-priority train that has waited at least --age-limit is moved into
+    its direction's high queue, keeping its ready time, then the default
+    rules pick as usual.
+*/
+static int choose_aging(sim_t *sim, sched_state_t *st) {
+    int64_t now = policy_now(sim);
+    ready_queue *low[2] = { &sim->east_low, &sim->west_low };
+    ready_queue *high[2] = { &sim->east_high, &sim->west_high };
+    for (int d = 0; d < 2; d++) {
+        while (low[d]->size && now - low[d]->heap[0].ready_ns >= age_limit_ns) {
+            int64_t ready_ns = low[d]->heap[0].ready_ns;
+            int idx = queue_pop(low[d]);
+            queue_push(sim, high[d], idx, ready_ns);
+        }
+    }
+    return choose_next_idx_full(sim, st);
+}
+
+/* Current simulated time as seen by the time-dependent policies. */
+static int64_t policy_now(sim_t *sim){
+    return virtual_time ? sim->virtual_now_ns : sim_now(sim);
 }
 
-static inline int64_t peek_ns(ready_node *h){
-    return (h ? h->ready_ns : INT64_MAX);
+/* Queue Peak Helper Functions */
+static inline int peek_idx(const ready_queue *q){
+    return (q->size ? q->heap[0].idx : -1);
 }
 
@@ -0,0 +1,240 @@
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+/*
+    mtsbench - benchmark harness for mts.
+    For every (mode, train count) pair it generates a workload with ./gen,
+    runs ./mts on it in a scratch directory and prints one tab-separated
+    row of wall time, dispatch latency (from --metrics), context switches
+    and peak RSS. Rows come out in a fixed order, so the output of two
+    commits can be compared with diff.
+*/
+
+#define MAX_RUNS 32
+
+static char scratch[64]; //mkdtemp("/tmp/mtsbench.XXXXXX")
+static char mts_path[PATH_MAX];
+static char gen_path[PATH_MAX];
+
+static void usage(const char *prog){
+    fprintf(stderr,
+        "Usage: %s [-n \"10 100 1000 10000 100000\"] [-m \"virtual timer threads\"]\n"
+        "          [-t time_scale] [-T max_threads] [-l loading_dist] [-c crossing_dist] [-s seed]\n", prog);
+}
+
+/* Split a space separated list into words. Returns the word count. */
+static int split(char *s, char **out, int max){
+    int n = 0;
+    for(char *save = NULL, *tok = strtok_r(s, " ,", &save); tok && n < max; tok = strtok_r(NULL, " ,", &save)){
+        out[n++] = tok;
+    }
+    return n;
+}
+
+/*
+    fork + exec argv with stdout sent to out_path (or /dev/null) and cwd set
+    to the scratch directory. Fills *ru from wait4 and returns the exit status,
+    or -1 if the child could not be run.
+*/
+static int run(char **argv, const char *out_path, struct rusage *ru){
+    pid_t pid = fork();
+    if(pid < 0){
+        perror("fork");
+        return -1;
+    }
+    if(pid == 0){
+        if(chdir(scratch) != 0){
+            _exit(126);
+        }
+        int fd = open(out_path ? out_path : "/dev/null", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if(fd >= 0){
+            dup2(fd, STDOUT_FILENO);
+            close(fd);
+        }
+        execv(argv[0], argv);
+        perror(argv[0]);
+        _exit(127);
+    }
+    int status;
+    while(wait4(pid, &status, 0, ru) == -1){
+        if(errno != EINTR){
+            perror("wait4");
+            return -1;
+        }
+    }
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+}
+
+/* Pull "key": <number> out of the object that follows section in a metrics file. */
+static long long metric(const char *json, const char *section, const char *key){
+    const char *p = strstr(json, section);
+    if(!p){
+        return -1;
+    }
+    char pat[64];
+    snprintf(pat, sizeof pat, "\"%s\": ", key);
+    p = strstr(p, pat);
+    return p ? atoll(p + strlen(pat)) : -1;
+}
+
+static char* slurp(const char *path){
+    FILE *f = fopen(path, "r");
+    if(!f){
+        return NULL;
+    }
+    size_t cap = 1 << 16, len = 0;
+    char *buf = malloc(cap + 1);
+    size_t r;
+    while(buf && (r = fread(buf + len, 1, cap - len, f)) > 0){
+        len += r;
+        if(len == cap){
+            cap *= 2;
+            char *tmp = realloc(buf, cap + 1);
+            if(!tmp){
+                free(buf);
+            }
+            buf = tmp;
+        }
+    }
+    fclose(f);
+    if(buf){
+        buf[len] = '\0';
+    }
+    return buf;
+}
+
+int main(int argc, char **argv){
+    char sizes_arg[256] = "10 100 1000 10000 100000";
+    char modes_arg[256] = "virtual timer threads";
+    const char *scale = "0.0001";
+    const char *load = "u:1:99";
+    const char *cross = "u:1:10";
+    const char *seed = "42";
+    long max_threads = 10000;
+
+    int opt;
+    while((opt = getopt(argc, argv, "n:m:t:T:l:c:s:h")) != -1){
+        switch(opt){
+            case 'n': snprintf(sizes_arg, sizeof sizes_arg, "%s", optarg); break;
+            case 'm': snprintf(modes_arg, sizeof modes_arg, "%s", optarg); break;
+            case 't': scale = optarg; break;
+            case 'T': max_threads = atol(optarg); break;
+            case 'l': load = optarg; break;
+            case 'c': cross = optarg; break;
+            case 's': seed = optarg; break;
+            default: usage(argv[0]); return 1;
+        }
+    }
+    char *sizes[MAX_RUNS], *modes[MAX_RUNS];
+    int n_sizes = split(sizes_arg, sizes, MAX_RUNS);
+    int n_modes = split(modes_arg, modes, MAX_RUNS);
+
+    if(!realpath("./mts", mts_path) || !realpath("./gen", gen_path)){
+        fprintf(stderr, "mtsbench: run from the directory holding mts and gen (make bench)\n");
+        return 1;
+    }
+    snprintf(scratch, sizeof scratch, "/tmp/mtsbench.XXXXXX");
+    if(!mkdtemp(scratch)){
+        perror("mkdtemp");
+        return 1;
+    }
+
+    printf("# mtsbench time_scale=%s loading=%s crossing=%s seed=%s\n", scale, load, cross, seed);
+    printf("mode\ttrains\twall_ms\tdispatch_p50_us\tdispatch_p99_us\twait_max_ms\tctx_switches\tpeak_rss_kb\n");
+    fflush(stdout);
+
+    int failed = 0;
+    for(int s = 0; s < n_sizes; s++){
+        char input[PATH_MAX];
+        snprintf(input, sizeof input, "%s/in_%s.txt", scratch, sizes[s]);
+        char *gen_argv[] = { gen_path, "-n", sizes[s], "-s", (char*)seed, "-l", (char*)load, "-c", (char*)cross, NULL };
+        struct rusage ru;
+        if(run(gen_argv, input, &ru) != 0){
+            fprintf(stderr, "mtsbench: gen failed for %s trains\n", sizes[s]);
+            failed = 1;
+            continue;
+        }
+
+        for(int m = 0; m < n_modes; m++){
+            const char *mode_flag = NULL;
+            if(strcmp(modes[m], "virtual") == 0){
+                mode_flag = "--virtual-time";
+            }
+            else if(strcmp(modes[m], "timer") == 0){
+                mode_flag = "--timer-thread";
+            }
+            else if(strcmp(modes[m], "handoff") == 0){
+                mode_flag = "--handoff";
+            }
+            else if(strcmp(modes[m], "threads") != 0){
+                fprintf(stderr, "mtsbench: unknown mode %s\n", modes[m]);
+                return 1;
+            }
+            if(strcmp(modes[m], "threads") == 0 && atol(sizes[s]) > max_threads){
+                continue; //one thread per train does not scale this far
+            }
+
+            char *mts_argv[8];
+            int a = 0;
+            mts_argv[a++] = mts_path;
+            if(mode_flag){
+                mts_argv[a++] = (char*)mode_flag;
+            }
+            mts_argv[a++] = "--time-scale";
+            mts_argv[a++] = (char*)scale;
+            mts_argv[a++] = "--metrics=metrics.json";
+            mts_argv[a++] = input;
+            mts_argv[a] = NULL;
+
+            struct timespec t0, t1;
+            clock_gettime(CLOCK_MONOTONIC, &t0);
+            int rc = run(mts_argv, NULL, &ru);
+            clock_gettime(CLOCK_MONOTONIC, &t1);
+            if(rc != 0){
+                fprintf(stderr, "mtsbench: mts %s failed on %s trains (status %d)\n", modes[m], sizes[s], rc);
+                failed = 1;
+                continue;
+            }
+            double wall_ms = (double)(t1.tv_sec - t0.tv_sec) * 1e3 + (double)(t1.tv_nsec - t0.tv_nsec) / 1e6;
+
+            //Latencies in the metrics file are simulated time; convert back to real time
+            double sc = atof(scale);
+            char metrics_path[PATH_MAX];
+            snprintf(metrics_path, sizeof metrics_path, "%s/metrics.json", scratch);
+            char *json = slurp(metrics_path);
+            long long p50 = json ? metric(json, "\"dispatch_ns\"", "p50") : -1;
+            long long p99 = json ? metric(json, "\"dispatch_ns\"", "p99") : -1;
+            long long wmax_hi = json ? metric(json, "\"high\"", "max") : -1;
+            long long wmax_lo = json ? metric(json, "\"low\"", "max") : -1;
+            free(json);
+            long long wmax = wmax_hi > wmax_lo ? wmax_hi : wmax_lo;
+
+            printf("%s\t%s\t%.1f\t%.1f\t%.1f\t%.1f\t%ld\t%ld\n", modes[m], sizes[s], wall_ms,
+                   p50 < 0 ? -1.0 : (double)p50 * sc / 1e3, p99 < 0 ? -1.0 : (double)p99 * sc / 1e3,
+                   wmax < 0 ? -1.0 : (double)wmax / 1e6,
+                   ru.ru_nvcsw + ru.ru_nivcsw, ru.ru_maxrss);
+            fflush(stdout);
+        }
+        unlink(input);
+    }
+
+    char path[PATH_MAX];
+    snprintf(path, sizeof path, "%s/metrics.json", scratch);
+    unlink(path);
+    snprintf(path, sizeof path, "%s/output.txt", scratch);
+    unlink(path);
+    rmdir(scratch);
+    return failed;
+}
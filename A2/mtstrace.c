@@ -0,0 +1,245 @@
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+
+/*
+    mtstrace - companion tool for mts --trace.
+    "render" turns a binary trace back into the output.txt text format;
+    "diff" compares two traces event by event and reports where they differ,
+    so two runs can be checked against each other without parsing text.
+*/
+
+/* Must match the --trace layout in mts.c */
+#define TRACE_MAGIC   "MTSTRACE"
+#define TRACE_VERSION 1
+
+typedef struct {
+    int64_t ns;
+    int32_t id;
+    uint8_t event;      //0 ready, 1 ON, 2 OFF
+    uint8_t dir;        //0 East, 1 West
+    uint8_t track;
+    uint8_t high;
+} trace_rec;
+
+typedef struct {
+    char magic[8];
+    uint16_t version;
+    uint16_t rec_size;
+    uint16_t n_tracks;
+    uint16_t reserved;
+} trace_header;
+
+typedef struct {
+    const char *path;
+    FILE *f;
+    trace_header h;
+} trace_file;
+
+static void usage(const char *prog){
+    fprintf(stderr,
+        "Usage: %s render TRACE\n"
+        "       %s diff [-t tolerance_ns] [-n max_reported] TRACE_A TRACE_B\n", prog, prog);
+}
+
+/* Open a trace and check its header. Returns 0 on success, -1 on error. */
+static int trace_open(trace_file *tf, const char *path){
+    tf->path = path;
+    tf->f = fopen(path, "rb");
+    if(!tf->f){
+        perror(path);
+        return -1;
+    }
+    if(fread(&tf->h, sizeof tf->h, 1, tf->f) != 1 || memcmp(tf->h.magic, TRACE_MAGIC, sizeof tf->h.magic) != 0){
+        fprintf(stderr, "%s: not an mts trace\n", path);
+        fclose(tf->f);
+        return -1;
+    }
+    if(tf->h.version != TRACE_VERSION || tf->h.rec_size != sizeof(trace_rec)){
+        fprintf(stderr, "%s: unsupported trace version %u (record size %u)\n",
+                path, (unsigned)tf->h.version, (unsigned)tf->h.rec_size);
+        fclose(tf->f);
+        return -1;
+    }
+    return 0;
+}
+
+/* Next record: 1 if one was read, 0 at the end, -1 on a truncated or unreadable file. */
+static int trace_next(trace_file *tf, trace_rec *r){
+    size_t got = fread(r, 1, sizeof *r, tf->f);
+    if(got == sizeof *r){
+        return 1;
+    }
+    if(got == 0 && !ferror(tf->f)){
+        return 0;
+    }
+    fprintf(stderr, "%s: truncated trace\n", tf->path);
+    return -1;
+}
+
+/* Same text mts writes to output.txt for this event */
+static void format_rec(const trace_rec *r, int n_tracks, char *buf, size_t n){
+    int64_t total_ms = r->ns / 1000000LL;
+    long hours = (long)(total_ms / 3600000LL);
+    long mins = (long)(total_ms % 3600000LL / 60000LL);
+    long secs = (long)(total_ms % 60000LL / 1000LL);
+    long tenths = (long)(total_ms % 1000LL / 100LL);
+    const char *dir = r->dir == 0 ? "East" : "West";
+    char where[16] = "";
+    if(r->event != 0 && n_tracks > 1){
+        snprintf(where, sizeof where, " (track %d)", r->track);
+    }
+    switch(r->event){
+        case 0:
+            snprintf(buf, n, "%02ld:%02ld:%02ld.%1ld Train %2d is ready to go %4s\n",
+                     hours, mins, secs, tenths, (int)r->id, dir);
+            break;
+        case 1:
+            snprintf(buf, n, "%02ld:%02ld:%02ld.%1ld Train %2d is ON the main track going %4s%s\n",
+                     hours, mins, secs, tenths, (int)r->id, dir, where);
+            break;
+        default:
+            snprintf(buf, n, "%02ld:%02ld:%02ld.%1ld Train %2d is OFF the main track after going %4s%s\n",
+                     hours, mins, secs, tenths, (int)r->id, dir, where);
+            break;
+    }
+}
+
+static int render(const char *path){
+    trace_file tf;
+    if(trace_open(&tf, path) != 0){
+        return 2;
+    }
+    static char out[1 << 16];
+    setvbuf(stdout, out, _IOFBF, sizeof out);
+    trace_rec r;
+    int rc;
+    char line[160];
+    while((rc = trace_next(&tf, &r)) == 1){
+        format_rec(&r, tf.h.n_tracks, line, sizeof line);
+        fputs(line, stdout);
+    }
+    fclose(tf.f);
+    if(fflush(stdout) != 0){
+        perror("stdout");
+        return 2;
+    }
+    return rc < 0 ? 2 : 0;
+}
+
+/* Records match if everything but the time is equal and the times are within tol_ns. */
+static int same_event(const trace_rec *a, const trace_rec *b, int64_t tol_ns){
+    int64_t d = a->ns - b->ns;
+    if(d < 0){
+        d = -d;
+    }
+    return a->id == b->id && a->event == b->event && a->dir == b->dir
+        && a->track == b->track && a->high == b->high && d <= tol_ns;
+}
+
+/*
+    Walk both traces in step and print each differing event as a -/+ pair of
+    rendered lines. Exit status: 0 identical, 1 different, 2 error.
+*/
+static int diff(const char *path_a, const char *path_b, int64_t tol_ns, long max_report){
+    trace_file a, b;
+    if(trace_open(&a, path_a) != 0){
+        return 2;
+    }
+    if(trace_open(&b, path_b) != 0){
+        fclose(a.f);
+        return 2;
+    }
+    long index = 0, differ = 0;
+    long only_a = 0, only_b = 0;
+    int rc = 0;
+    for(;;){
+        trace_rec ra, rb;
+        int ga = trace_next(&a, &ra);
+        int gb = trace_next(&b, &rb);
+        if(ga < 0 || gb < 0){
+            rc = 2;
+            break;
+        }
+        if(!ga && !gb){
+            break;
+        }
+        if(ga && gb && same_event(&ra, &rb, tol_ns)){
+            index++;
+            continue;
+        }
+        if(ga && gb){
+            differ++;
+        }
+        else if(ga){
+            only_a++;
+        }
+        else{
+            only_b++;
+        }
+        if(differ + only_a + only_b <= max_report){
+            char line[160];
+            printf("event %ld:\n", index);
+            if(ga){
+                format_rec(&ra, a.h.n_tracks, line, sizeof line);
+                printf("- %s", line);
+            }
+            if(gb){
+                format_rec(&rb, b.h.n_tracks, line, sizeof line);
+                printf("+ %s", line);
+            }
+        }
+        index++;
+    }
+    fclose(a.f);
+    fclose(b.f);
+    if(rc != 0){
+        return rc;
+    }
+    if(differ || only_a || only_b){
+        printf("%ld of %ld events differ", differ, index);
+        if(only_a || only_b){
+            printf(", %ld only in %s, %ld only in %s", only_a, path_a, only_b, path_b);
+        }
+        printf("\n");
+        return 1;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv){
+    if(argc < 2){
+        usage(argv[0]);
+        return 2;
+    }
+    if(strcmp(argv[1], "render") == 0){
+        if(argc != 3){
+            usage(argv[0]);
+            return 2;
+        }
+        return render(argv[2]);
+    }
+    if(strcmp(argv[1], "diff") == 0){
+        int64_t tol_ns = 0;
+        long max_report = 20;
+        int opt;
+        optind = 2;
+        while((opt = getopt(argc, argv, "t:n:")) != -1){
+            switch(opt){
+                case 't': tol_ns = strtoll(optarg, NULL, 10); break;
+                case 'n': max_report = atol(optarg); break;
+                default: usage(argv[0]); return 2;
+            }
+        }
+        if(optind != argc - 2 || tol_ns < 0){
+            usage(argv[0]);
+            return 2;
+        }
+        return diff(argv[optind], argv[optind + 1], tol_ns, max_report);
+    }
+    usage(argv[0]);
+    return 2;
+}
@@ -0,0 +1,67 @@
+#!/bin/sh
+# --metrics under --convoy: overlapping crossings on a track must be counted
+# once, so no busy_ns exceeds the time available and no idle_ns goes negative.
+# Run from A2 (make test).
+set -eu
+
+MTS=$(pwd)/mts
+tmp=$(mktemp -d /tmp/mtstest.XXXXXX)
+trap 'rm -rf "$tmp"' EXIT
+fail=0
+
+# check NAME METRICS_FILE: each track's busy_ns and idle_ns lie in
+# [0, makespan]; a direction's busy_ns (summed over tracks) in
+# [0, makespan * tracks]
+check() {
+    awk -v name="$1" '
+        function num(s) { gsub(/[^0-9-]/, "", s); return s + 0 }
+        function within(what, v, hi) {
+            n++
+            if (v < 0 || v > hi) {
+                printf "FAIL %s: %s %.0f outside [0, %.0f]\n", name, what, v, hi
+                bad = 1
+            }
+        }
+        /"tracks":/      { tracks = num($2) }
+        /"makespan_ns":/ { makespan = num($2) }
+        {
+            for (i = 1; i < NF; i++) {
+                if ($i == "\"busy_ns\":" && /"track":/) {
+                    within("track busy_ns", num($(i + 1)), makespan)
+                }
+                else if ($i == "\"busy_ns\":") {
+                    within("direction busy_ns", num($(i + 1)), makespan * tracks)
+                }
+                else if ($i == "\"idle_ns\":") {
+                    within("track idle_ns", num($(i + 1)), makespan)
+                }
+            }
+        }
+        END { if (n == 0) { printf "FAIL %s: no busy/idle fields\n", name; bad = 1 } exit bad }
+    ' "$2" || fail=1
+}
+
+# Four East trains that ready together: with --convoy 1 they cross 1.0-2.3 s
+printf 'e 10 10\ne 10 10\ne 10 10\ne 10 10\n' > "$tmp/four.txt"
+(cd "$tmp" && "$MTS" --virtual-time --convoy 1 --metrics four.json four.txt > /dev/null)
+check "four East, --convoy 1" "$tmp/four.json"
+if ! grep -q '"track": 0, "trains": 4, "busy_ns": 1300000000, "idle_ns": 1000000000' "$tmp/four.json"; then
+    echo "FAIL four East, --convoy 1: expected busy 1.3 s and idle 1.0 s on track 0"
+    fail=1
+fi
+
+# A mixed load over several tracks with long convoys
+i=0
+: > "$tmp/mixed.txt"
+while [ $i -lt 200 ]; do
+    case $((i % 4)) in
+        0) d=E ;; 1) d=w ;; 2) d=e ;; *) d=W ;;
+    esac
+    echo "$d $((i % 7 + 1)) $((i % 5 + 3))" >> "$tmp/mixed.txt"
+    i=$((i + 1))
+done
+(cd "$tmp" && "$MTS" --virtual-time --tracks 3 --convoy 1 --convoy-max 8 --metrics mixed.json mixed.txt > /dev/null)
+check "mixed, --tracks 3 --convoy 1" "$tmp/mixed.json"
+
+[ $fail -eq 0 ] && echo "convoy_metrics: ok"
+exit $fail